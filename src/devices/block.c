@@ -4,6 +4,14 @@
 #include <stdio.h>
 #include "devices/ide.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Most sectors that merged requests may add up to, and the size
+   in pages of the buffer they are transferred through. */
+#define MERGE_MAX_SECTORS 64
+#define MERGE_PAGES (MERGE_MAX_SECTORS * BLOCK_SECTOR_SIZE / PGSIZE)
 
 /* A block device. */
 struct block
@@ -19,6 +27,14 @@ struct block
 
     unsigned long long read_cnt;        /* Number of sectors read. */
     unsigned long long write_cnt;       /* Number of sectors written. */
+
+    /* Asynchronous request queue. */
+    struct lock queue_lock;             /* Protects the members below. */
+    struct condition queue_ready;       /* Signaled when queue non-empty. */
+    struct list queue;                  /* Pending requests, by sector. */
+    block_sector_t queue_pos;           /* Sector after last dispatched. */
+    bool dispatching;                   /* Dispatcher thread started? */
+    uint8_t *merge_buf;                 /* Merged transfers, or null. */
   };
 
 /* List of all block devices. */
@@ -28,6 +44,10 @@ static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 static struct block *block_by_role[BLOCK_ROLE_CNT];
 
 static struct block *list_elem_to_block (struct list_elem *);
+static bool request_less (const struct list_elem *,
+                          const struct list_elem *, void *aux);
+static size_t take_requests (struct block *, struct list *);
+static thread_func dispatch NO_RETURN;
 
 /* Returns a human-readable name for the given block device
    TYPE. */
@@ -139,6 +159,107 @@ block_write (struct block *block, block_sector_t sector, const void *buffer)
   block->write_cnt++;
 }
 
+/* Reads CNT consecutive sectors starting at SECTOR from BLOCK
+   into BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes.  Drivers that can transfer several sectors with one
+   command do so; others are called once per sector.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_read_multi (struct block *block, block_sector_t sector, size_t cnt,
+                  void *buffer)
+{
+  size_t i;
+
+  if (cnt == 0)
+    return;
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  if (block->ops->read_multi != NULL)
+    block->ops->read_multi (block->aux, sector, cnt, buffer);
+  else
+    for (i = 0; i < cnt; i++)
+      block->ops->read (block->aux, sector + i,
+                        (uint8_t *) buffer + i * BLOCK_SECTOR_SIZE);
+  block->read_cnt += cnt;
+}
+
+/* Writes CNT consecutive sectors starting at SECTOR to BLOCK
+   from BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Returns after the block device has acknowledged receiving the
+   data.  Drivers that can transfer several sectors with one
+   command do so; others are called once per sector.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_write_multi (struct block *block, block_sector_t sector, size_t cnt,
+                   const void *buffer)
+{
+  size_t i;
+
+  if (cnt == 0)
+    return;
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  ASSERT (block->type != BLOCK_FOREIGN);
+  if (block->ops->write_multi != NULL)
+    block->ops->write_multi (block->aux, sector, cnt, buffer);
+  else
+    for (i = 0; i < cnt; i++)
+      block->ops->write (block->aux, sector + i,
+                         (const uint8_t *) buffer + i * BLOCK_SECTOR_SIZE);
+  block->write_cnt += cnt;
+}
+
+/* Initializes REQ to move CNT sectors starting at SECTOR between
+   a block device and BUFFER, writing to the device if WRITE and
+   reading from it otherwise. */
+void
+block_request_init (struct block_request *req, block_sector_t sector,
+                    size_t cnt, void *buffer, bool write)
+{
+  ASSERT (cnt > 0);
+
+  req->sector = sector;
+  req->cnt = cnt;
+  req->buffer = buffer;
+  req->write = write;
+  sema_init (&req->done, 0);
+}
+
+/* Queues REQ on BLOCK and returns without waiting for it.  REQ
+   and its buffer must stay valid until block_wait() on REQ
+   returns.  Starts BLOCK's dispatcher thread on first use. */
+void
+block_submit (struct block *block, struct block_request *req)
+{
+  check_sector (block, req->sector);
+  check_sector (block, req->sector + req->cnt - 1);
+  ASSERT (!req->write || block->type != BLOCK_FOREIGN);
+
+  lock_acquire (&block->queue_lock);
+  if (!block->dispatching)
+    {
+      char name[sizeof block->name + 3];
+
+      snprintf (name, sizeof name, "%s-io", block->name);
+      if (thread_create (name, PRI_DEFAULT, dispatch, block) == TID_ERROR)
+        PANIC ("%s: failed to start request dispatcher", block->name);
+      block->merge_buf = palloc_get_multiple (0, MERGE_PAGES);
+      block->dispatching = true;
+    }
+  list_insert_ordered (&block->queue, &req->elem, request_less, NULL);
+  cond_signal (&block->queue_ready, &block->queue_lock);
+  lock_release (&block->queue_lock);
+}
+
+/* Waits for REQ, submitted with block_submit(), to complete. */
+void
+block_wait (struct block_request *req)
+{
+  sema_down (&req->done);
+}
+
 /* Returns the number of sectors in BLOCK. */
 block_sector_t
 block_size (struct block *block)
@@ -200,6 +321,12 @@ block_register (const char *name, enum block_type type,
   block->aux = aux;
   block->read_cnt = 0;
   block->write_cnt = 0;
+  lock_init (&block->queue_lock);
+  cond_init (&block->queue_ready);
+  list_init (&block->queue);
+  block->queue_pos = 0;
+  block->dispatching = false;
+  block->merge_buf = NULL;
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
@@ -221,3 +348,132 @@ list_elem_to_block (struct list_elem *list_elem)
           : NULL);
 }
 
+
+/* Orders requests by first sector.  Requests for the same sector
+   keep their submission order. */
+static bool
+request_less (const struct list_elem *a_, const struct list_elem *b_,
+              void *aux UNUSED)
+{
+  const struct block_request *a = list_entry (a_, struct block_request, elem);
+  const struct block_request *b = list_entry (b_, struct block_request, elem);
+
+  return a->sector < b->sector;
+}
+
+/* Moves the next requests to serve from BLOCK's queue, which
+   must not be empty, to BATCH and returns their total number of
+   sectors.  Following C-LOOK, that is the first request at or
+   past the last dispatched sector, wrapping around to the lowest
+   sector once there are none.  Requests after it that continue
+   where it ends, in the same direction, are merged into the
+   batch while they fit in the merge buffer.  The caller must
+   hold BLOCK's queue lock. */
+static size_t
+take_requests (struct block *block, struct list *batch)
+{
+  struct list_elem *e;
+  struct block_request *first;
+  size_t cnt;
+
+  ASSERT (!list_empty (&block->queue));
+
+  for (e = list_begin (&block->queue); e != list_end (&block->queue);
+       e = list_next (e))
+    if (list_entry (e, struct block_request, elem)->sector >= block->queue_pos)
+      break;
+  if (e == list_end (&block->queue))
+    e = list_begin (&block->queue);
+
+  first = list_entry (e, struct block_request, elem);
+  cnt = first->cnt;
+  e = list_remove (e);
+  list_push_back (batch, &first->elem);
+
+  if (block->merge_buf != NULL)
+    while (e != list_end (&block->queue))
+      {
+        struct block_request *next = list_entry (e, struct block_request,
+                                                 elem);
+        if (next->sector != first->sector + cnt || next->write != first->write
+            || cnt + next->cnt > MERGE_MAX_SECTORS)
+          break;
+        cnt += next->cnt;
+        e = list_remove (e);
+        list_push_back (batch, &next->elem);
+      }
+
+  block->queue_pos = first->sector + cnt;
+  return cnt;
+}
+
+/* Dispatcher thread for the block device passed as AUX.  Serves
+   its queue one batch at a time, so that the device is kept busy
+   while submitters get on with other work. */
+static void
+dispatch (void *block_)
+{
+  struct block *block = block_;
+
+  for (;;)
+    {
+      struct list batch;
+      struct block_request *first;
+      struct list_elem *e;
+      size_t cnt;
+
+      list_init (&batch);
+      lock_acquire (&block->queue_lock);
+      while (list_empty (&block->queue))
+        cond_wait (&block->queue_ready, &block->queue_lock);
+      cnt = take_requests (block, &batch);
+      lock_release (&block->queue_lock);
+
+      first = list_entry (list_front (&batch), struct block_request, elem);
+      if (first->cnt == cnt)
+        {
+          /* A lone request is transferred in place. */
+          if (first->write)
+            block_write_multi (block, first->sector, cnt, first->buffer);
+          else
+            block_read_multi (block, first->sector, cnt, first->buffer);
+        }
+      else if (first->write)
+        {
+          uint8_t *p = block->merge_buf;
+
+          for (e = list_begin (&batch); e != list_end (&batch);
+               e = list_next (e))
+            {
+              struct block_request *req = list_entry (e, struct block_request,
+                                                      elem);
+              memcpy (p, req->buffer, req->cnt * BLOCK_SECTOR_SIZE);
+              p += req->cnt * BLOCK_SECTOR_SIZE;
+            }
+          block_write_multi (block, first->sector, cnt, block->merge_buf);
+        }
+      else
+        {
+          uint8_t *p = block->merge_buf;
+
+          block_read_multi (block, first->sector, cnt, block->merge_buf);
+          for (e = list_begin (&batch); e != list_end (&batch);
+               e = list_next (e))
+            {
+              struct block_request *req = list_entry (e, struct block_request,
+                                                      elem);
+              memcpy (req->buffer, p, req->cnt * BLOCK_SECTOR_SIZE);
+              p += req->cnt * BLOCK_SECTOR_SIZE;
+            }
+        }
+
+      /* Wake the submitters.  A request may be reused as soon as
+         its semaphore is up'd, so take it off the batch first. */
+      while (!list_empty (&batch))
+        {
+          struct block_request *req = list_entry (list_pop_front (&batch),
+                                                  struct block_request, elem);
+          sema_up (&req->done);
+        }
+    }
+}
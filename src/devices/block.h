@@ -3,6 +3,8 @@
 
 #include <stddef.h>
 #include <inttypes.h>
+#include <list.h>
+#include "threads/synch.h"
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -53,9 +55,38 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multi (struct block *, block_sector_t, size_t cnt, void *);
+void block_write_multi (struct block *, block_sector_t, size_t cnt,
+                        const void *);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
+/* Asynchronous requests.
+
+   A request moves CNT consecutive sectors starting at SECTOR
+   between a block device and BUFFER.  block_submit() queues it
+   and returns at once; the device's dispatcher thread serves its
+   queue in C-LOOK order, merging requests for adjacent sectors
+   in the same direction into one transfer.  block_wait() returns
+   once the request has completed.  Requests that overlap are not
+   ordered against each other, nor against the synchronous calls
+   above, so callers must not have such requests in flight at
+   once. */
+struct block_request
+  {
+    struct list_elem elem;      /* Element in device's queue. */
+    block_sector_t sector;      /* First sector. */
+    size_t cnt;                 /* Number of sectors. */
+    void *buffer;               /* CNT * BLOCK_SECTOR_SIZE bytes. */
+    bool write;                 /* True to write, false to read. */
+    struct semaphore done;      /* Up'd on completion. */
+  };
+
+void block_request_init (struct block_request *, block_sector_t,
+                         size_t cnt, void *buffer, bool write);
+void block_submit (struct block *, struct block_request *);
+void block_wait (struct block_request *);
+
 /* Statistics. */
 void block_print_stats (void);
 
@@ -65,6 +96,13 @@ struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+
+    /* Optional.  Transfer CNT consecutive sectors at once.  If
+       null, the block layer falls back to one read or write per
+       sector. */
+    void (*read_multi) (void *aux, block_sector_t, size_t cnt, void *buffer);
+    void (*write_multi) (void *aux, block_sector_t, size_t cnt,
+                         const void *buffer);
   };
 
 struct block *block_register (const char *name, enum block_type,
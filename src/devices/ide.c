@@ -3,12 +3,15 @@
 #include <debug.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include "devices/block.h"
 #include "devices/partition.h"
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
    controller.  It attempts to comply to [ATA-3]. */
@@ -30,10 +33,26 @@
 #define reg_ctl(CHANNEL) ((CHANNEL)->reg_base + 0x206)  /* Control (w/o). */
 #define reg_alt_status(CHANNEL) reg_ctl (CHANNEL)       /* Alt Status (r/o). */
 
+/* Bus master IDE port addresses, relative to the channel's
+   bus master base. */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bm_base + 0) /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)  /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)    /* PRD table. */
+
 /* Alternate Status Register bits. */
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
+#define STA_DF 0x20             /* Device Fault. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
+
+/* Bus Master Command Register bits. */
+#define BM_CMD_READ 0x08        /* Transfer from disk to memory. */
+#define BM_CMD_START 0x01       /* Start transfer. */
+
+/* Bus Master Status Register bits. */
+#define BM_STA_INTR 0x04        /* Interrupt, write 1 to clear. */
+#define BM_STA_ERR 0x02         /* Error, write 1 to clear. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +68,32 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_DMA 0xc8               /* READ DMA with retries. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA with retries. */
+
+/* Most sectors one READ or WRITE SECTOR command can transfer.
+   The Sector Count register is 8 bits wide and 0 means 256. */
+#define MAX_SECTORS_PER_CMD 256
+
+/* Most sectors one DMA command transfers.  Buffers outside the
+   kernel's mapping of physical memory are staged through a
+   bounce buffer this large. */
+#define DMA_MAX_SECTORS 64
+#define DMA_BOUNCE_PAGES (DMA_MAX_SECTORS * BLOCK_SECTOR_SIZE / PGSIZE)
+
+/* PCI configuration space access, mechanism #1. */
+#define PCI_CONFIG_ADDR 0xcf8   /* Address of register to access. */
+#define PCI_CONFIG_DATA 0xcfc   /* Contents of that register. */
+
+/* A physical region descriptor, one entry in the table that
+   tells the bus master where to move a DMA transfer's data. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address of region. */
+    uint16_t size;              /* Size in bytes, 0 means 64 kB. */
+    uint16_t flags;             /* PRD_EOT on the last entry. */
+  };
+#define PRD_EOT 0x8000          /* End of table. */
 
 /* An ATA device. */
 struct ata_disk
@@ -57,6 +102,7 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    bool dma;                   /* Transfer by bus-master DMA? */
   };
 
 /* An ATA channel (aka controller).
@@ -66,6 +112,9 @@ struct channel
     char name[8];               /* Name, e.g. "ide0". */
     uint16_t reg_base;          /* Base I/O port. */
     uint8_t irq;                /* Interrupt in use. */
+    uint16_t bm_base;           /* Bus master I/O port, 0 if none. */
+    struct prd *prdt;           /* PRD table for DMA transfers. */
+    uint8_t *bounce;            /* DMA bounce buffer, DMA_BOUNCE_PAGES. */
 
     struct lock lock;           /* Must acquire to access the controller. */
     bool expecting_interrupt;   /* True if an interrupt is expected, false if
@@ -81,14 +130,21 @@ static struct channel channels[CHANNEL_CNT];
 
 static struct block_operations ide_operations;
 
+static uint16_t find_bus_master (void);
+static void init_dma (struct channel *);
 static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void select_sector (struct ata_disk *, block_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
+static void pio_read (struct ata_disk *, block_sector_t, size_t, void *);
+static void pio_write (struct ata_disk *, block_sector_t, size_t,
+                       const void *);
+static bool dma_transfer (struct ata_disk *, block_sector_t, size_t,
+                          void *, bool read);
 
 static void wait_until_idle (const struct ata_disk *);
 static bool wait_while_busy (const struct ata_disk *);
@@ -101,6 +157,7 @@ static void interrupt_handler (struct intr_frame *);
 void
 ide_init (void) 
 {
+  uint16_t bm_base = find_bus_master ();
   size_t chan_no;
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
@@ -123,6 +180,9 @@ ide_init (void)
         default:
           NOT_REACHED ();
         }
+      c->bm_base = bm_base != 0 ? bm_base + chan_no * 8 : 0;
+      c->prdt = NULL;
+      c->bounce = NULL;
       lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
@@ -136,6 +196,7 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->dma = false;
         }
 
       /* Register interrupt handler. */
@@ -152,6 +213,10 @@ ide_init (void)
       for (dev_no = 0; dev_no < 2; dev_no++)
         if (c->devices[dev_no].is_ata)
           identify_ata_device (&c->devices[dev_no]);
+
+      /* Set up DMA if any disk can use it. */
+      if (c->devices[0].dma || c->devices[1].dma)
+        init_dma (c);
     }
 }
 
@@ -159,6 +224,84 @@ ide_init (void)
 
 static char *descramble_ata_string (char *, int size);
 
+/* Reads the 32-bit PCI configuration register REG of function
+   FUNC of device DEV on bus 0. */
+static uint32_t
+pci_read_config (int dev, int func, int reg)
+{
+  outl (PCI_CONFIG_ADDR, 0x80000000 | (dev << 11) | (func << 8) | reg);
+  return inl (PCI_CONFIG_DATA);
+}
+
+/* Writes VALUE to the 32-bit PCI configuration register REG of
+   function FUNC of device DEV on bus 0. */
+static void
+pci_write_config (int dev, int func, int reg, uint32_t value)
+{
+  outl (PCI_CONFIG_ADDR, 0x80000000 | (dev << 11) | (func << 8) | reg);
+  outl (PCI_CONFIG_DATA, value);
+}
+
+/* Looks on PCI bus 0 for an IDE controller that runs both
+   channels at the legacy ports and can act as a bus master, as
+   the PIIX does.  Enables bus mastering and returns the base of
+   its bus master ports, or 0 if there is no such controller, in
+   which case disks are driven in PIO mode only. */
+static uint16_t
+find_bus_master (void)
+{
+  int dev, func;
+
+  for (dev = 0; dev < 32; dev++)
+    for (func = 0; func < 8; func++)
+      {
+        uint32_t class, bar;
+
+        if ((pci_read_config (dev, func, 0x00) & 0xffff) == 0xffff)
+          {
+            if (func == 0)
+              break;
+            continue;
+          }
+
+        /* Class 1, subclass 1 is IDE.  In the programming
+           interface, bit 7 means bus master capable and bits 0 and
+           2 mean native rather than legacy ports. */
+        class = pci_read_config (dev, func, 0x08);
+        if ((class >> 16) != 0x0101 || (class & 0x8000) == 0
+            || (class & 0x0500) != 0)
+          continue;
+
+        /* BAR4 holds the bus master ports. */
+        bar = pci_read_config (dev, func, 0x20);
+        if ((bar & 1) == 0 || (bar & 0xfffc) == 0)
+          continue;
+
+        /* Enable I/O space and bus mastering. */
+        pci_write_config (dev, func, 0x04,
+                          pci_read_config (dev, func, 0x04) | 0x05);
+        return bar & 0xfffc;
+      }
+  return 0;
+}
+
+/* Allocates channel C's PRD table and bounce buffer.  If memory
+   is short, C's disks fall back to PIO. */
+static void
+init_dma (struct channel *c) 
+{
+  c->prdt = palloc_get_page (0);
+  c->bounce = palloc_get_multiple (0, DMA_BOUNCE_PAGES);
+  if (c->prdt == NULL || c->bounce == NULL)
+    {
+      palloc_free_page (c->prdt);
+      palloc_free_multiple (c->bounce, DMA_BOUNCE_PAGES);
+      c->devices[0].dma = c->devices[1].dma = false;
+      return;
+    }
+  outb (reg_bm_command (c), 0);
+}
+
 /* Resets an ATA channel and waits for any devices present on it
    to finish the reset. */
 static void
@@ -303,6 +446,9 @@ identify_ata_device (struct ata_disk *d)
       return;
     }
 
+  /* Word 49 bit 8 says the disk supports DMA. */
+  d->dma = c->bm_base != 0 && (*(uint16_t *) &id[49 * 2] & 0x100) != 0;
+
   /* Register. */
   block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
                           &ide_operations, d);
@@ -337,63 +483,132 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
-/* Reads sector SEC_NO from disk D into BUFFER, which must have
-   room for BLOCK_SECTOR_SIZE bytes.
+/* Reads CNT sectors starting at SEC_NO from disk D into BUFFER,
+   which must have room for CNT * BLOCK_SECTOR_SIZE bytes.  Uses
+   DMA if D supports it, switching D to PIO for good if a DMA
+   transfer fails.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_read (void *d_, block_sector_t sec_no, void *buffer)
+ide_read_multi (void *d_, block_sector_t sec_no, size_t cnt, void *buffer_)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  uint8_t *buffer = buffer_;
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
+  while (cnt > 0)
+    {
+      size_t n;
+
+      if (d->dma)
+        {
+          n = cnt < DMA_MAX_SECTORS ? cnt : DMA_MAX_SECTORS;
+          if (!dma_transfer (d, sec_no, n, buffer, true))
+            {
+              printf ("%s: DMA read failed, sector=%"PRDSNu", using PIO\n",
+                      d->name, sec_no);
+              d->dma = false;
+              continue;
+            }
+        }
+      else 
+        {
+          n = cnt < MAX_SECTORS_PER_CMD ? cnt : MAX_SECTORS_PER_CMD;
+          pio_read (d, sec_no, n, buffer);
+        }
+      sec_no += n;
+      cnt -= n;
+      buffer += n * BLOCK_SECTOR_SIZE;
+    }
   lock_release (&c->lock);
 }
 
-/* Write sector SEC_NO to disk D from BUFFER, which must contain
-   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
-   acknowledged receiving the data.
+/* Writes CNT sectors starting at SEC_NO to disk D from BUFFER,
+   which must contain CNT * BLOCK_SECTOR_SIZE bytes.  Returns
+   after the disk has acknowledged receiving the data.  Uses DMA
+   if D supports it, switching D to PIO for good if a DMA
+   transfer fails.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+ide_write_multi (void *d_, block_sector_t sec_no, size_t cnt,
+                 const void *buffer_)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  const uint8_t *buffer = buffer_;
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
+  while (cnt > 0)
+    {
+      size_t n;
+
+      if (d->dma)
+        {
+          n = cnt < DMA_MAX_SECTORS ? cnt : DMA_MAX_SECTORS;
+          if (!dma_transfer (d, sec_no, n, (void *) buffer, false))
+            {
+              printf ("%s: DMA write failed, sector=%"PRDSNu", using PIO\n",
+                      d->name, sec_no);
+              d->dma = false;
+              continue;
+            }
+        }
+      else 
+        {
+          n = cnt < MAX_SECTORS_PER_CMD ? cnt : MAX_SECTORS_PER_CMD;
+          pio_write (d, sec_no, n, buffer);
+        }
+      sec_no += n;
+      cnt -= n;
+      buffer += n * BLOCK_SECTOR_SIZE;
+    }
   lock_release (&c->lock);
 }
 
+/* Reads sector SEC_NO from disk D into BUFFER, which must have
+   room for BLOCK_SECTOR_SIZE bytes.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_read (void *d_, block_sector_t sec_no, void *buffer)
+{
+  ide_read_multi (d_, sec_no, 1, buffer);
+}
+
+/* Write sector SEC_NO to disk D from BUFFER, which must contain
+   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
+   acknowledged receiving the data.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+{
+  ide_write_multi (d_, sec_no, 1, buffer);
+}
+
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_multi,
+    ide_write_multi
   };
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and the sector count CNT to the disk's sector
+   selection registers.  (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
   ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt >= 1 && cnt <= MAX_SECTORS_PER_CMD);
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt == MAX_SECTORS_PER_CMD ? 0 : cnt);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -430,6 +645,117 @@ output_sector (struct channel *c, const void *sector)
   outsw (reg_data (c), sector, BLOCK_SECTOR_SIZE / 2);
 }
 
+/* Reads CNT sectors, at most MAX_SECTORS_PER_CMD, starting at
+   SEC_NO from disk D into BUFFER in PIO mode.  The disk
+   interrupts once per sector as its data becomes ready.  The
+   caller must hold D's channel lock. */
+static void
+pio_read (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+          void *buffer_)
+{
+  struct channel *c = d->channel;
+  uint8_t *buffer = buffer_;
+  size_t i;
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
+  for (i = 0; i < cnt; i++)
+    {
+      sema_down (&c->completion_wait);
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no + i);
+      input_sector (c, buffer);
+      buffer += BLOCK_SECTOR_SIZE;
+    }
+}
+
+/* Writes CNT sectors, at most MAX_SECTORS_PER_CMD, starting at
+   SEC_NO to disk D from BUFFER in PIO mode.  The disk interrupts
+   once per sector after taking its data.  The caller must hold
+   D's channel lock. */
+static void
+pio_write (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+           const void *buffer_)
+{
+  struct channel *c = d->channel;
+  const uint8_t *buffer = buffer_;
+  size_t i;
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
+  for (i = 0; i < cnt; i++)
+    {
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no + i);
+      output_sector (c, buffer);
+      buffer += BLOCK_SECTOR_SIZE;
+      sema_down (&c->completion_wait);
+    }
+}
+
+/* Moves CNT sectors, at most DMA_MAX_SECTORS, starting at SEC_NO
+   between disk D and BUFFER by bus-master DMA, into BUFFER if
+   READ and out of it otherwise.  Kernel buffers are handed to
+   the controller in place, with one PRD per page so that no
+   region crosses a 64 kB boundary; others, such as user
+   buffers, go through the channel's bounce buffer.  The CPU is
+   free while the controller moves the data.  Returns false if
+   the transfer failed.  The caller must hold D's channel lock. */
+static bool
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              void *buffer, bool read) 
+{
+  struct channel *c = d->channel;
+  size_t size = cnt * BLOCK_SECTOR_SIZE;
+  uint8_t *region = is_kernel_vaddr (buffer) ? buffer : c->bounce;
+  uint8_t dir = read ? BM_CMD_READ : 0;
+  uint8_t bm_status;
+  size_t prd_cnt, ofs;
+
+  ASSERT (cnt >= 1 && cnt <= DMA_MAX_SECTORS);
+
+  if (!read && region != buffer)
+    memcpy (region, buffer, size);
+
+  /* Build the PRD table. */
+  for (prd_cnt = ofs = 0; ofs < size; prd_cnt++)
+    {
+      uint8_t *p = region + ofs;
+      size_t chunk = PGSIZE - pg_ofs (p);
+      if (chunk > size - ofs)
+        chunk = size - ofs;
+
+      c->prdt[prd_cnt].addr = vtop (p);
+      c->prdt[prd_cnt].size = chunk;
+      c->prdt[prd_cnt].flags = 0;
+      ofs += chunk;
+    }
+  c->prdt[prd_cnt - 1].flags = PRD_EOT;
+
+  /* Program the bus master, issue the command, and start the
+     transfer.  The disk interrupts once when it is done. */
+  outl (reg_bm_prdt (c), vtop (c->prdt));
+  outb (reg_bm_command (c), dir);
+  outb (reg_bm_status (c), inb (reg_bm_status (c)) | BM_STA_INTR | BM_STA_ERR);
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, read ? CMD_READ_DMA : CMD_WRITE_DMA);
+  outb (reg_bm_command (c), dir | BM_CMD_START);
+  sema_down (&c->completion_wait);
+
+  /* Stop the bus master and check for errors. */
+  bm_status = inb (reg_bm_status (c));
+  outb (reg_bm_command (c), dir);
+  outb (reg_bm_status (c), bm_status | BM_STA_INTR | BM_STA_ERR);
+  wait_while_busy (d);
+  if ((bm_status & BM_STA_ERR) != 0
+      || (inb (reg_alt_status (c)) & (STA_ERR | STA_DF)) != 0)
+    return false;
+
+  if (read && region != buffer)
+    memcpy (buffer, region, size);
+  return true;
+}
+
 /* Low-level ATA primitives. */
 
 /* Wait up to 10 seconds for the controller to become idle, that
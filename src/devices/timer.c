@@ -20,6 +20,9 @@
 /* Number of timer ticks since OS booted. */
 static int64_t ticks;
 
+/* Armed timer alarms, ordered by wakeup tick. */
+static struct list alarm_list;
+
 /* Number of loops per timer tick.
    Initialized by timer_calibrate(). */
 static unsigned loops_per_tick;
@@ -36,6 +39,7 @@ void
 timer_init (void) 
 {
   pit_configure_channel (0, 2, TIMER_FREQ);
+  list_init (&alarm_list);
   intr_register_ext (0x20, timer_interrupt, "8254 Timer");
 }
 
@@ -96,6 +100,49 @@ timer_sleep (int64_t ticks)
     thread_yield ();
 }
 
+/* Returns true if alarm A fires before alarm B. */
+static bool
+alarm_less (const struct list_elem *a_, const struct list_elem *b_,
+            void *aux UNUSED)
+{
+  const struct timer_alarm *a = list_entry (a_, struct timer_alarm, elem);
+  const struct timer_alarm *b = list_entry (b_, struct timer_alarm, elem);
+
+  return a->wakeup < b->wakeup;
+}
+
+/* Arms ALARM to up SEMA once, approximately TICKS timer ticks
+   from now.  ALARM must not already be armed. */
+void
+timer_alarm_set (struct timer_alarm *alarm, struct semaphore *sema,
+                 int64_t ticks)
+{
+  enum intr_level old_level;
+
+  ASSERT (!alarm->armed);
+
+  old_level = intr_disable ();
+  alarm->wakeup = timer_ticks () + ticks;
+  alarm->sema = sema;
+  alarm->armed = true;
+  list_insert_ordered (&alarm_list, &alarm->elem, alarm_less, NULL);
+  intr_set_level (old_level);
+}
+
+/* Disarms ALARM if it has not fired yet. */
+void
+timer_alarm_cancel (struct timer_alarm *alarm)
+{
+  enum intr_level old_level = intr_disable ();
+
+  if (alarm->armed)
+    {
+      list_remove (&alarm->elem);
+      alarm->armed = false;
+    }
+  intr_set_level (old_level);
+}
+
 /* Sleeps for approximately MS milliseconds.  Interrupts must be
    turned on. */
 void
@@ -171,6 +218,16 @@ static void
 timer_interrupt (struct intr_frame *args UNUSED)
 {
   ticks++;
+  while (!list_empty (&alarm_list))
+    {
+      struct timer_alarm *alarm = list_entry (list_front (&alarm_list),
+                                              struct timer_alarm, elem);
+      if (alarm->wakeup > ticks)
+        break;
+      list_pop_front (&alarm_list);
+      alarm->armed = false;
+      sema_up (alarm->sema);
+    }
   thread_tick ();
 }
 
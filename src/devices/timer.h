@@ -1,7 +1,9 @@
 #ifndef DEVICES_TIMER_H
 #define DEVICES_TIMER_H
 
+#include <list.h>
 #include <round.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 /* Number of timer interrupts per second. */
@@ -24,6 +26,20 @@ void timer_mdelay (int64_t milliseconds);
 void timer_udelay (int64_t microseconds);
 void timer_ndelay (int64_t nanoseconds);
 
+/* A semaphore to be upped at a given tick, for sleeping until an
+   event or a timeout, whichever comes first. */
+struct timer_alarm
+  {
+    int64_t wakeup;             /* Tick at which to fire. */
+    struct semaphore *sema;     /* Upped when it fires. */
+    bool armed;                 /* In the alarm list. */
+    struct list_elem elem;      /* Alarm list element. */
+  };
+
+void timer_alarm_set (struct timer_alarm *, struct semaphore *,
+                      int64_t ticks);
+void timer_alarm_cancel (struct timer_alarm *);
+
 void timer_print_stats (void);
 
 #endif /* devices/timer.h */
@@ -1,117 +1,765 @@
 #include "filesys/buffer_cache.h"
 #include "threads/palloc.h"
+#include "threads/malloc.h"
+#include "threads/vaddr.h"
+#include "threads/thread.h"
+#include "devices/timer.h"
+#include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
+#include <round.h>
 #include <debug.h>
 
-#define BUFFER_CACHE_ENTRY_NB 64
-static char p_buffer_cache[BUFFER_CACHE_ENTRY_NB * BLOCK_SECTOR_SIZE];
-static struct buffer_head buffer_head[BUFFER_CACHE_ENTRY_NB];
+/* sectors held by one page of cache memory */
+#define BC_SECTORS_PER_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* -bc: number of pages to take from the user pool, set before bc_init */
+static size_t bc_page_cnt = BC_DEFAULT_PAGES;
+
+/* -bcflush, -bcdirty: write-behind period and dirty high-water mark */
+static int64_t bc_flush_ticks = BC_DEFAULT_FLUSH_MS * TIMER_FREQ / 1000;
+static unsigned bc_dirty_ratio = BC_DEFAULT_DIRTY_RATIO;
+
+static size_t bc_entry_cnt;
+static struct buffer_head *buffer_head;
 static struct buffer_head *clock_hand;
+static size_t bc_dirty_cnt;
+
+/* protects bc_hash, clock_hand, bc_dirty_cnt, bc_flush_woken and
+   the sector, valid, dirty, clock and pin_cnt members of every
+   buffer_head.  A head's
+   data is guarded by its own lock, which may only be taken while
+   the head is pinned. */
+static struct lock bc_lock;
+
+/* dirty sectors gathered by the flusher, sorted, and the pages
+   that contiguous runs of them are copied into, one run per page,
+   for writes that are in flight together */
+#define BC_FLUSH_BATCH 8
+static block_sector_t *bc_flush_list;
+static uint8_t *bc_flush_buf;
+static struct lock bc_flush_lock;
+
+/* the flusher sleeps on bc_flush_sema until its period is up or
+   bc_put takes the cache over the dirty high-water mark, which
+   wakes it once per pass through bc_flush_woken */
+static struct semaphore bc_flush_sema;
+static bool bc_flush_woken;
+
+/* run by the flusher before each pass, see bc_add_flush_hook */
+#define BC_FLUSH_HOOKS 4
+static bc_flush_hook *bc_flush_hooks[BC_FLUSH_HOOKS];
+static size_t bc_flush_hook_cnt;
+
+/* sectors waiting for the read-ahead thread, a ring buffer */
+#define BC_RA_QUEUE_SIZE 64
+static block_sector_t bc_ra_queue[BC_RA_QUEUE_SIZE];
+static size_t bc_ra_head, bc_ra_cnt;
+static struct lock bc_ra_lock;
+static struct condition bc_ra_cond;
+
+/* sector -> buffer_head index of every valid entry */
+static struct hash bc_hash;
+
+static unsigned bc_hash_func (const struct hash_elem *, void * UNUSED);
+static bool bc_less_func (const struct hash_elem *, const struct hash_elem *, void * UNUSED);
+static struct buffer_head *bc_claim (block_sector_t);
+static struct buffer_head *bc_get (block_sector_t, bool);
+static struct buffer_head *bc_get_cached (block_sector_t);
+static struct buffer_head *bc_get_uncached (block_sector_t);
+static void bc_touch (const void *, size_t, bool);
+static void bc_put (struct buffer_head *, bool);
+static void bc_unpin (struct buffer_head *);
+static bool bc_over_dirty_ratio (void);
+static void bc_flush_all (void);
+static size_t bc_flush_run (const block_sector_t *, size_t,
+                            struct block_request *,
+                            struct buffer_head **, uint8_t *);
+static int bc_sector_cmp (const void *, const void *);
+static thread_func bc_flush_daemon NO_RETURN;
+static thread_func bc_read_ahead_daemon NO_RETURN;
+static void bc_read_ahead_finish (struct block_request *,
+                                  struct buffer_head **, size_t);
+
+
+/* set how many pages bc_init takes for the cache */
+void
+bc_configure (size_t page_cnt)
+{
+  bc_page_cnt = page_cnt > 0 ? page_cnt : 1;
+}
 
+/* set write-behind period in milliseconds */
+void
+bc_configure_flush (int ms)
+{
+  bc_flush_ticks = (int64_t) ms * TIMER_FREQ / 1000;
+  if (bc_flush_ticks < 1)
+    bc_flush_ticks = 1;
+}
+
+/* set percentage of dirty entries that wakes the flusher early */
+void
+bc_configure_dirty (int ratio)
+{
+  bc_dirty_ratio = ratio > 0 && ratio <= 100 ? ratio : BC_DEFAULT_DIRTY_RATIO;
+}
 
+/* allocate cache pages from palloc, at most what fs_device can fill */
 void
 bc_init (void)
 {
-  struct buffer_head *head;
-  char *cache = p_buffer_cache;
+  size_t max_pages = DIV_ROUND_UP (block_size (fs_device), BC_SECTORS_PER_PAGE);
+  size_t page_cnt = bc_page_cnt < max_pages ? bc_page_cnt : max_pages;
+  size_t i, j;
 
-  for (head = buffer_head; head != buffer_head + BUFFER_CACHE_ENTRY_NB; head++, cache += BLOCK_SECTOR_SIZE)
+  buffer_head = calloc (page_cnt * BC_SECTORS_PER_PAGE, sizeof *buffer_head);
+  if (buffer_head == NULL)
+    PANIC ("buffer cache heads allocation failed");
+
+  bc_entry_cnt = 0;
+  for (i = 0; i < page_cnt; i++)
   {
-    memset (head, 0, sizeof (struct buffer_head));
-    head->data = cache;
+    char *cache = palloc_get_page (PAL_USER);
+    if (cache == NULL)
+      break;
+
+    for (j = 0; j < BC_SECTORS_PER_PAGE; j++, cache += BLOCK_SECTOR_SIZE)
+    {
+      lock_init (&buffer_head[bc_entry_cnt].lock);
+      buffer_head[bc_entry_cnt++].data = cache;
+    }
   }
+  if (bc_entry_cnt == 0)
+    PANIC ("buffer cache allocation failed");
+  printf ("buffer cache: %zu sectors in %zu pages.\n",
+          bc_entry_cnt, bc_entry_cnt / BC_SECTORS_PER_PAGE);
 
   clock_hand = buffer_head;
+  bc_dirty_cnt = 0;
+  lock_init (&bc_lock);
+  if (!hash_init (&bc_hash, bc_hash_func, bc_less_func, NULL))
+    PANIC ("buffer cache index creation failed");
+
+  lock_init (&bc_flush_lock);
+  sema_init (&bc_flush_sema, 0);
+  bc_flush_woken = false;
+  bc_flush_list = malloc (bc_entry_cnt * sizeof *bc_flush_list);
+  bc_flush_buf = palloc_get_multiple (0, BC_FLUSH_BATCH);
+  if (bc_flush_list == NULL || bc_flush_buf == NULL
+      || thread_create ("bc_flush", PRI_DEFAULT, bc_flush_daemon, NULL) == TID_ERROR)
+    PANIC ("buffer cache flusher creation failed");
+
+  bc_ra_head = bc_ra_cnt = 0;
+  lock_init (&bc_ra_lock);
+  cond_init (&bc_ra_cond);
+  if (thread_create ("bc_read_ahead", PRI_DEFAULT, bc_read_ahead_daemon, NULL) == TID_ERROR)
+    PANIC ("buffer cache read-ahead creation failed");
 }
 
 
 void
 bc_term (void)
 {
-  struct buffer_head *head;
-
-  for (head = buffer_head; head != buffer_head + BUFFER_CACHE_ENTRY_NB; head++)
-    bc_flush_entry (head);
+  bc_flush_all ();
 }
 
 
+/* BUFFER may be a user buffer, whose pages can fault in while it
+   is copied, and the fault may need this very sector, e.g. for an
+   mmap'd page of the same file.  So the data goes through a bounce
+   buffer and the user buffer is touched only without the head's
+   lock held. */
 bool
 bc_read (block_sector_t sector_idx, void *buffer, off_t bytes_written, int chunk_size, int sector_ofs)
 {
+  uint8_t bounce[BLOCK_SECTOR_SIZE];
+  struct buffer_head *head = bc_get (sector_idx, true);
+
+  memcpy (bounce, head->data + sector_ofs, chunk_size);
+  bc_put (head, false);
+  memcpy (buffer + bytes_written, bounce, chunk_size);
+  return true;
+}
+
+bool
+bc_write (block_sector_t sector_idx, const void *buffer, off_t bytes_written, int chunk_size, int sector_ofs)
+{
+  /* a whole-sector write need not read the old contents */
+  bool partial = sector_ofs != 0 || chunk_size != BLOCK_SECTOR_SIZE;
+  uint8_t bounce[BLOCK_SECTOR_SIZE];
   struct buffer_head *head;
 
-  if (!(head = bc_lookup (sector_idx)))
+  memcpy (bounce, buffer + bytes_written, chunk_size);
+  head = bc_get (sector_idx, partial);
+  memcpy (head->data + sector_ofs, bounce, chunk_size);
+  bc_put (head, true);
+  return true;
+}
+
+/* read CNT whole sectors from SECTOR into BUFFER without caching
+   them, as one disk transfer.  If any of them is cached it may be
+   newer than the disk, so the run is read sector by sector, using
+   the cached copies where present, copied out like in bc_read. */
+void
+bc_read_direct (block_sector_t sector, size_t cnt, void *buffer)
+{
+  uint8_t bounce[BLOCK_SECTOR_SIZE];
+  uint8_t *dst = buffer;
+  bool cached = false;
+  size_t i;
+
+  lock_acquire (&bc_lock);
+  for (i = 0; i < cnt && !cached; i++)
+    cached = bc_lookup (sector + i) != NULL;
+  lock_release (&bc_lock);
+
+  if (!cached)
   {
-    head = bc_select_victim ();
-    bc_flush_entry (head);
-    head->valid = true;
-    head->dirty = false;
-    head->sector = sector_idx;
-    block_read (fs_device, sector_idx, head->data);
+    bc_touch (buffer, cnt * BLOCK_SECTOR_SIZE, true);
+    block_read_multi (fs_device, sector, cnt, buffer);
+    return;
   }
 
-  head->clock = true;
-  memcpy (buffer + bytes_written, head->data + sector_ofs, chunk_size);
-  return true;
+  for (i = 0; i < cnt; i++, dst += BLOCK_SECTOR_SIZE)
+  {
+    struct buffer_head *head = bc_get_cached (sector + i);
+
+    if (head != NULL)
+    {
+      memcpy (bounce, head->data, BLOCK_SECTOR_SIZE);
+      bc_put (head, false);
+      memcpy (dst, bounce, BLOCK_SECTOR_SIZE);
+    }
+    else
+    {
+      bc_touch (dst, BLOCK_SECTOR_SIZE, true);
+      block_read (fs_device, sector + i, dst);
+    }
+  }
 }
 
-bool
-bc_write (block_sector_t sector_idx, void *buffer, off_t bytes_written, int chunk_size, int sector_ofs)
+/* write CNT whole sectors from BUFFER to SECTOR without caching
+   them, as one disk transfer.  Cached copies, including ones loaded
+   while the write was in flight (e.g. by read-ahead), are then
+   overwritten so they cannot go stale, and left dirty since an
+   older write-behind of the sector may land after ours.  They are
+   copied in like in bc_write. */
+void
+bc_write_direct (block_sector_t sector, size_t cnt, const void *buffer)
 {
-  struct buffer_head *head;
+  uint8_t bounce[BLOCK_SECTOR_SIZE];
+  const uint8_t *src = buffer;
+  size_t i;
+
+  bc_touch (buffer, cnt * BLOCK_SECTOR_SIZE, false);
+  block_write_multi (fs_device, sector, cnt, buffer);
 
-  if (!(head = bc_lookup (sector_idx)))
+  for (i = 0; i < cnt; i++, src += BLOCK_SECTOR_SIZE)
   {
-    head = bc_select_victim ();
-    bc_flush_entry (head);
-    head->valid = true;
-    head->sector = sector_idx;
-    block_read (fs_device, sector_idx, head->data);
+    struct buffer_head *head;
+
+    memcpy (bounce, src, BLOCK_SECTOR_SIZE);
+    head = bc_get_cached (sector + i);
+    if (head != NULL)
+    {
+      memcpy (head->data, bounce, BLOCK_SECTOR_SIZE);
+      bc_put (head, true);
+    }
   }
+}
 
-  head->clock = true;
-  head->dirty = true;
-  memcpy (head->data + sector_ofs, buffer + bytes_written, chunk_size);
-  return true;
+/* have the flusher call HOOK before each write-behind pass, for
+   layers above the cache to put their own pending changes into it */
+void
+bc_add_flush_hook (bc_flush_hook *hook)
+{
+  ASSERT (bc_flush_hook_cnt < BC_FLUSH_HOOKS);
+  bc_flush_hooks[bc_flush_hook_cnt++] = hook;
+}
+
+/* queue SECTOR to be brought into the cache by the read-ahead
+   thread, dropping the request if the queue is full */
+void
+bc_read_ahead (block_sector_t sector)
+{
+  lock_acquire (&bc_ra_lock);
+  if (bc_ra_cnt < BC_RA_QUEUE_SIZE)
+  {
+    bc_ra_queue[(bc_ra_head + bc_ra_cnt++) % BC_RA_QUEUE_SIZE] = sector;
+    cond_signal (&bc_ra_cond, &bc_ra_lock);
+  }
+  lock_release (&bc_ra_lock);
 }
 
+/* find buffer_head caching SECTOR through bc_hash,
+   caller must hold bc_lock */
 struct buffer_head *
 bc_lookup (block_sector_t sector)
+{
+  struct buffer_head key;
+  struct hash_elem *e;
+
+  ASSERT (lock_held_by_current_thread (&bc_lock));
+  key.sector = sector;
+  e = hash_find (&bc_hash, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct buffer_head, hash_elem) : NULL;
+}
+
+/* clock over the unpinned heads, passing over dirty ones for two
+   revolutions so that the flusher rather than the caller writes
+   them.  Returns NULL if every head is pinned.
+   Caller must hold bc_lock. */
+struct buffer_head *
+bc_select_victim (void)
 {
   struct buffer_head *head;
+  size_t scanned;
 
-  for (head = buffer_head; head != buffer_head + BUFFER_CACHE_ENTRY_NB; head++)
+  ASSERT (lock_held_by_current_thread (&bc_lock));
+  for (scanned = 0; ; scanned++)
   {
-    if (head->valid && head->sector == sector)
+    if (clock_hand == buffer_head + bc_entry_cnt)
+      clock_hand = buffer_head;
+    head = clock_hand++;
+
+    if (scanned >= 3 * bc_entry_cnt)
+      return NULL;
+    if (head->pin_cnt > 0)
+      continue;
+    if (!head->valid)
+      return head;
+    if (head->clock)
+      head->clock = false;
+    else if (!head->dirty || scanned >= 2 * bc_entry_cnt)
       return head;
   }
+}
 
+/* write P_FLUSH_ENTRY back if dirty, caller must hold its lock */
+void
+bc_flush_entry (struct buffer_head *p_flush_entry)
+{
+  bool dirty;
+
+  ASSERT (lock_held_by_current_thread (&p_flush_entry->lock));
+  lock_acquire (&bc_lock);
+  dirty = p_flush_entry->valid && p_flush_entry->dirty;
+  if (dirty)
+  {
+    p_flush_entry->dirty = false;
+    bc_dirty_cnt--;
+  }
+  lock_release (&bc_lock);
+
+  if (dirty)
+    block_write (fs_device, p_flush_entry->sector, p_flush_entry->data);
+}
+
+/* rebind a victim to SECTOR, which is not cached, and return it
+   pinned and locked with bc_lock released.  Returns NULL with
+   bc_lock still held if no clean victim was at hand, after writing
+   a dirty one back or yielding, so the caller must look SECTOR up
+   again.  Caller must hold bc_lock. */
+static struct buffer_head *
+bc_claim (block_sector_t sector)
+{
+  struct buffer_head *head = bc_select_victim ();
+
+  if (head == NULL)
+  {
+    lock_release (&bc_lock);
+    thread_yield ();
+    lock_acquire (&bc_lock);
+    return NULL;
+  }
+  head->pin_cnt++;
+
+  if (!head->dirty)
+  {
+    /* unpinned until now, so nobody holds its lock */
+    lock_acquire (&head->lock);
+    if (head->valid)
+      hash_delete (&bc_hash, &head->hash_elem);
+    head->valid = true;
+    head->sector = sector;
+    head->clock = true;
+    hash_insert (&bc_hash, &head->hash_elem);
+    lock_release (&bc_lock);
+    return head;
+  }
+
+  /* write a dirty victim back under its old sector before reusing
+     it, so a concurrent miss on that sector never reads stale data */
+  lock_release (&bc_lock);
+  lock_acquire (&head->lock);
+  bc_flush_entry (head);
+  lock_release (&head->lock);
+  lock_acquire (&bc_lock);
+  head->pin_cnt--;
   return NULL;
 }
 
-struct buffer_head *
-bc_select_victim (void)
+/* return the pinned and locked head caching SECTOR.  On a miss a
+   clean victim is rebound to SECTOR and, if LOAD, read from disk
+   while only its own lock is held; lookups of SECTOR meanwhile
+   wait on that lock instead of on bc_lock. */
+static struct buffer_head *
+bc_get (block_sector_t sector, bool load)
 {
-  while (true)
+  struct buffer_head *head;
+
+  lock_acquire (&bc_lock);
+  while ((head = bc_lookup (sector)) == NULL)
+    if ((head = bc_claim (sector)) != NULL)
+    {
+      if (load)
+        block_read (fs_device, sector, head->data);
+      return head;
+    }
+
+  head->pin_cnt++;
+  head->clock = true;
+  lock_release (&bc_lock);
+  lock_acquire (&head->lock);
+  return head;
+}
+
+/* true if SECTOR is cached or being read in, found without
+   loading it or waiting for its head */
+bool
+bc_cached (block_sector_t sector)
+{
+  bool cached;
+
+  lock_acquire (&bc_lock);
+  cached = bc_lookup (sector) != NULL;
+  lock_release (&bc_lock);
+  return cached;
+}
+
+/* like bc_get, but return NULL instead of filling on a miss */
+static struct buffer_head *
+bc_get_cached (block_sector_t sector)
+{
+  struct buffer_head *head;
+
+  lock_acquire (&bc_lock);
+  head = bc_lookup (sector);
+  if (head != NULL)
+    head->pin_cnt++;
+  lock_release (&bc_lock);
+
+  if (head != NULL)
+    lock_acquire (&head->lock);
+  return head;
+}
+
+/* like bc_get on a miss, without loading, but return NULL without
+   waiting for anything if SECTOR is already cached */
+static struct buffer_head *
+bc_get_uncached (block_sector_t sector)
+{
+  struct buffer_head *head;
+
+  lock_acquire (&bc_lock);
+  while (bc_lookup (sector) == NULL)
+    if ((head = bc_claim (sector)) != NULL)
+      return head;
+  lock_release (&bc_lock);
+  return NULL;
+}
+
+/* fault in every page of the SIZE bytes at BUFFER, writing if
+   WRITE, so that a user buffer does not page fault inside the
+   block driver while it holds the channel lock */
+static void
+bc_touch (const void *buffer, size_t size, bool write)
+{
+  volatile uint8_t *p = (uint8_t *) buffer;
+  volatile uint8_t *last = p + size - 1;
+
+  for (;;)
+  {
+    if (write)
+      *p = *p;
+    else
+      (void) *p;
+    if (p == last)
+      break;
+    p = pg_round_down ((const void *) p) + PGSIZE;
+    if (p > last)
+      p = last;
+  }
+}
+
+/* unlock and unpin HEAD from bc_get, marking it dirty if DIRTY */
+static void
+bc_put (struct buffer_head *head, bool dirty)
+{
+  lock_release (&head->lock);
+
+  lock_acquire (&bc_lock);
+  if (dirty && !head->dirty)
   {
-    while (clock_hand != buffer_head + BUFFER_CACHE_ENTRY_NB)
+    head->dirty = true;
+    bc_dirty_cnt++;
+    if (!bc_flush_woken && bc_over_dirty_ratio ())
     {
-      if (!clock_hand->valid || !clock_hand->clock)
-        return clock_hand++;
-      clock_hand->clock = false;
-      clock_hand++;
+      bc_flush_woken = true;
+      sema_up (&bc_flush_sema);
     }
-    clock_hand = buffer_head;
   }
+  head->pin_cnt--;
+  lock_release (&bc_lock);
 }
 
-void
-bc_flush_entry (struct buffer_head *p_flush_entry)
+/* unpin HEAD, which the caller has already unlocked */
+static void
+bc_unpin (struct buffer_head *head)
 {
-  if (!p_flush_entry->valid || !p_flush_entry->dirty)
-    return;
+  lock_acquire (&bc_lock);
+  head->pin_cnt--;
+  lock_release (&bc_lock);
+}
+
+/* hash buffer_head with its sector number */
+static unsigned
+bc_hash_func (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct buffer_head, hash_elem)->sector);
+}
 
-  p_flush_entry->dirty = false;
-  block_write (fs_device, p_flush_entry->sector, p_flush_entry->data);
+/* return element with least sector */
+static bool
+bc_less_func (const struct hash_elem *a,
+              const struct hash_elem *b, void *aux UNUSED)
+{
+  return hash_entry (a, struct buffer_head, hash_elem)->sector
+      < hash_entry (b, struct buffer_head, hash_elem)->sector;
+}
+
+/* true if dirty entries reached the -bcdirty high-water mark */
+static bool
+bc_over_dirty_ratio (void)
+{
+  return bc_dirty_cnt * 100 >= bc_entry_cnt * bc_dirty_ratio;
+}
+
+/* write back every dirty entry in ascending sector order.  Each
+   contiguous run is copied out and queued for writing, BC_FLUSH_BATCH
+   runs at a time, so that the disk's elevator can merge them and
+   readers of the flushed sectors are held off only for the copy. */
+static void
+bc_flush_all (void)
+{
+  struct block_request reqs[BC_FLUSH_BATCH];
+  struct buffer_head *runs[BC_FLUSH_BATCH][BC_SECTORS_PER_PAGE];
+  struct buffer_head *head;
+  size_t cnt = 0, i, j, k;
+
+  lock_acquire (&bc_flush_lock);
+  lock_acquire (&bc_lock);
+  for (head = buffer_head; head != buffer_head + bc_entry_cnt; head++)
+    if (head->valid && head->dirty)
+      bc_flush_list[cnt++] = head->sector;
+  lock_release (&bc_lock);
+
+  qsort (bc_flush_list, cnt, sizeof *bc_flush_list, bc_sector_cmp);
+
+  for (i = 0; i < cnt; )
+  {
+    size_t batch = 0;
+
+    while (i < cnt && batch < BC_FLUSH_BATCH)
+    {
+      i += bc_flush_run (bc_flush_list + i, cnt - i, &reqs[batch],
+                         runs[batch], bc_flush_buf + batch * PGSIZE);
+      if (reqs[batch].cnt > 0)
+        block_submit (fs_device, &reqs[batch++]);
+    }
+
+    for (j = 0; j < batch; j++)
+    {
+      block_wait (&reqs[j]);
+      for (k = 0; k < reqs[j].cnt; k++)
+        bc_unpin (runs[j][k]);
+    }
+  }
+  lock_release (&bc_flush_lock);
+}
 
-}
\ No newline at end of file
+/* gather the dirty entries for the leading run of consecutive
+   sectors in the CNT sorted SECTORS, at most a page's worth, into
+   RUN, copy their data to the page at BUF and mark them clean.
+   REQ is set up to write BUF out, with a count of 0 if there was
+   nothing to write.  Only the first head's lock is waited for; the
+   run ends at a head that is busy, since its holder may itself be
+   waiting on one taken here.  The heads are returned unlocked but
+   still pinned, so that none is reloaded from disk before the write
+   lands.  Returns how many of SECTORS were consumed.  Caller must
+   hold bc_flush_lock. */
+static size_t
+bc_flush_run (const block_sector_t *sectors, size_t cnt,
+              struct block_request *req, struct buffer_head **run,
+              uint8_t *buf)
+{
+  size_t run_cnt = 0, used, i;
+
+  req->cnt = 0;
+  for (used = 0; used < cnt && run_cnt < BC_SECTORS_PER_PAGE; used++)
+  {
+    struct buffer_head *head;
+
+    if (run_cnt > 0 && sectors[used] != sectors[0] + run_cnt)
+      break;
+
+    lock_acquire (&bc_lock);
+    head = bc_lookup (sectors[used]);
+    if (head == NULL || !head->dirty)
+    {
+      lock_release (&bc_lock);
+      if (run_cnt == 0)
+        return 1;
+      break;
+    }
+    head->pin_cnt++;
+    lock_release (&bc_lock);
+
+    if (run_cnt == 0)
+      lock_acquire (&head->lock);
+    else if (!lock_try_acquire (&head->lock))
+    {
+      bc_unpin (head);
+      break;
+    }
+    run[run_cnt++] = head;
+  }
+
+  /* dirty may have been cleared by an eviction before we locked */
+  lock_acquire (&bc_lock);
+  for (i = 0; i < run_cnt; i++)
+  {
+    ASSERT (run[i]->valid && run[i]->sector == sectors[0] + i);
+    if (run[i]->dirty)
+    {
+      run[i]->dirty = false;
+      bc_dirty_cnt--;
+    }
+  }
+  lock_release (&bc_lock);
+
+  for (i = 0; i < run_cnt; i++)
+  {
+    memcpy (buf + i * BLOCK_SECTOR_SIZE, run[i]->data, BLOCK_SECTOR_SIZE);
+    lock_release (&run[i]->lock);
+  }
+
+  block_request_init (req, sectors[0], run_cnt, buf, true);
+  return used;
+}
+
+/* order sector numbers */
+static int
+bc_sector_cmp (const void *a_, const void *b_)
+{
+  block_sector_t a = *(const block_sector_t *) a_;
+  block_sector_t b = *(const block_sector_t *) b_;
+
+  return a < b ? -1 : a > b;
+}
+
+/* write-behind thread, runs every -bcflush ms or sooner when
+   too much of the cache is dirty.  The flush hooks run first, so
+   that what they put in the cache is written out too. */
+static void
+bc_flush_daemon (void *aux UNUSED)
+{
+  struct timer_alarm alarm;
+  size_t i;
+
+  alarm.armed = false;
+  for (;;)
+  {
+    timer_alarm_set (&alarm, &bc_flush_sema, bc_flush_ticks);
+    sema_down (&bc_flush_sema);
+    timer_alarm_cancel (&alarm);
+
+    /* the alarm may have fired along with a dirty wakeup */
+    while (sema_try_down (&bc_flush_sema))
+      continue;
+    lock_acquire (&bc_lock);
+    bc_flush_woken = false;
+    lock_release (&bc_lock);
+
+    for (i = 0; i < bc_flush_hook_cnt; i++)
+      bc_flush_hooks[i] ();
+    bc_flush_all ();
+  }
+}
+
+/* read-ahead thread, loads queued sectors that are not cached yet.
+   Everything queued is submitted at once, so that the disk's
+   elevator merges adjacent sectors into one transfer; each head
+   stays locked until its data is in. */
+static void
+bc_read_ahead_daemon (void *aux UNUSED)
+{
+  static struct block_request reqs[BC_RA_QUEUE_SIZE];
+  static struct buffer_head *heads[BC_RA_QUEUE_SIZE];
+  size_t max_submitted = bc_entry_cnt / 2;
+
+  if (max_submitted > BC_RA_QUEUE_SIZE)
+    max_submitted = BC_RA_QUEUE_SIZE;
+
+  for (;;)
+  {
+    block_sector_t sectors[BC_RA_QUEUE_SIZE];
+    size_t cnt, submitted = 0, i;
+
+    lock_acquire (&bc_ra_lock);
+    while (bc_ra_cnt == 0)
+      cond_wait (&bc_ra_cond, &bc_ra_lock);
+    for (cnt = 0; bc_ra_cnt > 0; cnt++)
+    {
+      sectors[cnt] = bc_ra_queue[bc_ra_head];
+      bc_ra_head = (bc_ra_head + 1) % BC_RA_QUEUE_SIZE;
+      bc_ra_cnt--;
+    }
+    lock_release (&bc_ra_lock);
+
+    for (i = 0; i < cnt; i++)
+    {
+      struct buffer_head *head;
+
+      /* leave half the cache unpinned for everyone else */
+      if (submitted >= max_submitted)
+      {
+        bc_read_ahead_finish (reqs, heads, submitted);
+        submitted = 0;
+      }
+      head = bc_get_uncached (sectors[i]);
+      if (head == NULL)
+        continue;
+
+      heads[submitted] = head;
+      block_request_init (&reqs[submitted], sectors[i], 1, head->data, false);
+      block_submit (fs_device, &reqs[submitted++]);
+    }
+    bc_read_ahead_finish (reqs, heads, submitted);
+  }
+}
+
+/* wait for the CNT read-ahead REQS and release their HEADS */
+static void
+bc_read_ahead_finish (struct block_request *reqs,
+                      struct buffer_head **heads, size_t cnt)
+{
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+  {
+    block_wait (&reqs[i]);
+    bc_put (heads[i], false);
+  }
+}
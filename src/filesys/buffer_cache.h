@@ -4,6 +4,7 @@
 #include "filesys/inode.h"
 #include "filesys/filesys.h"
 #include "threads/synch.h"
+#include <hash.h>
 
 struct buffer_head
 {
@@ -11,14 +12,34 @@ struct buffer_head
     bool valid;
     block_sector_t sector;
     bool clock;
-    struct lock lock;
+    int pin_cnt;                /* threads using or waiting on this head */
+    struct lock lock;           /* guards data and its disk I/O */
     void *data;
+    struct hash_elem hash_elem;
 };
 
+/* default cache size in pages (8 sectors each), override with -bc */
+#define BC_DEFAULT_PAGES 8
+
+/* write-behind defaults, override with -bcflush and -bcdirty */
+#define BC_DEFAULT_FLUSH_MS 1000
+#define BC_DEFAULT_DIRTY_RATIO 50
+
+/* called by the flusher before each write-behind pass */
+typedef void bc_flush_hook (void);
+
+void bc_configure (size_t page_cnt);
+void bc_configure_flush (int ms);
+void bc_configure_dirty (int ratio);
 void bc_init (void);
 void bc_term (void);
 bool bc_read (block_sector_t, void *, off_t, int, int);
-bool bc_write (block_sector_t, void *, off_t, int, int);
+bool bc_write (block_sector_t, const void *, off_t, int, int);
+bool bc_cached (block_sector_t);
+void bc_add_flush_hook (bc_flush_hook *);
+void bc_read_ahead (block_sector_t);
+void bc_read_direct (block_sector_t, size_t, void *);
+void bc_write_direct (block_sector_t, size_t, const void *);
 struct buffer_head *bc_lookup (block_sector_t);
 struct buffer_head *bc_select_victim (void);
 void bc_flush_entry (struct buffer_head *);
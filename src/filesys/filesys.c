@@ -26,6 +26,11 @@ filesys_init (bool format)
   free_map_init ();
   bc_init ();
 
+  /* Delayed file data is given sectors before the free map is
+     written, so that both reach the disk in the same pass. */
+  bc_add_flush_hook (inode_flush_delayed);
+  bc_add_flush_hook (free_map_flush);
+
   if (format) 
     do_format ();
 
@@ -37,6 +42,7 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
+  inode_flush_delayed ();
   free_map_close ();
   bc_term ();
 }
@@ -51,7 +57,8 @@ filesys_create (const char *name, off_t initial_size)
   block_sector_t inode_sector = 0;
   struct dir *dir = dir_open_root ();
   bool success = (dir != NULL
-                  && free_map_allocate (1, &inode_sector)
+                  && free_map_allocate_near (1, ROOT_DIR_SECTOR, NULL,
+                                             &inode_sector)
                   && inode_create (inode_sector, initial_size)
                   && dir_add (dir, name, inode_sector));
   if (!success && inode_sector != 0) 
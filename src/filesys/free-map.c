@@ -1,12 +1,59 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct lock free_map_lock;    /* Serializes allocation and release. */
+
+/* Free map bits held by each sector of the free map file. */
+#define MAP_SECTOR_BITS (BLOCK_SECTOR_SIZE * 8)
+
+/* Sectors of the free map file changed since they were last
+   written, one bit per sector.  Changes are written back by
+   free_map_flush() rather than as they are made. */
+static struct bitmap *dirty_map;
+
+/* Sectors summarized by each leaf of the free tree. */
+#define LEAF_SECTORS 32
+
+/* Free runs within a range of sectors. */
+struct free_summary
+  {
+    uint32_t pre;                    /* Free sectors at its start. */
+    uint32_t suf;                    /* Free sectors at its end. */
+    uint32_t best;                   /* Longest free run in it. */
+  };
+
+/* Free tree: a complete binary tree over the free map, stored as
+   an array with the children of node N at 2N and 2N+1, whose
+   leaves each summarize LEAF_SECTORS sectors.  It finds a free
+   run of a given length at or after a given sector in
+   logarithmic time. */
+static struct free_summary *free_tree;
+static size_t leaf_cnt;              /* Leaves, a power of 2. */
+
+#define NO_SECTOR ((size_t) -1)
+
+/* Free sectors, and how many of them are reserved for file data
+   that is held in memory until sectors are allocated for it.
+   Allocations leave the reserved sectors free, unless they are
+   made against a reservation of their own. */
+static size_t free_cnt;
+static size_t reserved_cnt;
+
+static void tree_build (void);
+static void tree_update (block_sector_t, size_t cnt);
+static size_t tree_search (size_t node, size_t lo, size_t hi,
+                           size_t from, size_t cnt);
+static void mark (block_sector_t, size_t cnt, bool used);
+static bool may_allocate (size_t cnt, size_t *reserved);
 
 /* Initializes the free map. */
 void
@@ -17,36 +64,320 @@ free_map_init (void)
     PANIC ("bitmap creation failed--file system device is too large");
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  lock_init (&free_map_lock);
+
+  dirty_map = bitmap_create (DIV_ROUND_UP (bitmap_size (free_map),
+                                           MAP_SECTOR_BITS));
+  if (dirty_map == NULL)
+    PANIC ("free map dirty bitmap creation failed");
+
+  for (leaf_cnt = 1; leaf_cnt * LEAF_SECTORS < bitmap_size (free_map);
+       leaf_cnt *= 2)
+    continue;
+  free_tree = malloc (2 * leaf_cnt * sizeof *free_tree);
+  if (free_tree == NULL)
+    PANIC ("free tree creation failed");
+  tree_build ();
+}
+
+/* Returns the summary of the LEAF_SECTORS sectors starting at
+   START.  Sectors past the end of the device count as used. */
+static struct free_summary
+leaf_summary (size_t start)
+{
+  struct free_summary sum = {0, 0, 0};
+  size_t run = 0;
+  size_t i;
+
+  for (i = 0; i < LEAF_SECTORS; i++)
+    {
+      size_t sector = start + i;
+      if (sector < bitmap_size (free_map) && !bitmap_test (free_map, sector))
+        {
+          run++;
+          if (run > sum.best)
+            sum.best = run;
+        }
+      else
+        {
+          if (run == i)
+            sum.pre = run;
+          run = 0;
+        }
+    }
+  if (run == LEAF_SECTORS)
+    sum.pre = run;
+  sum.suf = run;
+  return sum;
+}
+
+/* Sets node N of the free tree, covering LEN sectors, from its
+   children. */
+static void
+tree_pull (size_t n, size_t len)
+{
+  struct free_summary *l = &free_tree[2 * n];
+  struct free_summary *r = &free_tree[2 * n + 1];
+  struct free_summary *t = &free_tree[n];
+  size_t half = len / 2;
+
+  t->pre = l->pre == half ? half + r->pre : l->pre;
+  t->suf = r->suf == half ? half + l->suf : r->suf;
+  t->best = l->best > r->best ? l->best : r->best;
+  if (l->suf + r->pre > t->best)
+    t->best = l->suf + r->pre;
+}
+
+/* Returns the number of sectors node N of the free tree
+   covers. */
+static size_t
+node_len (size_t n)
+{
+  size_t len = LEAF_SECTORS * leaf_cnt;
+
+  for (; n > 1; n /= 2)
+    len /= 2;
+  return len;
+}
+
+/* Builds the free tree, and counts the free sectors, from the
+   free map. */
+static void
+tree_build (void)
+{
+  size_t n;
+
+  free_cnt = bitmap_count (free_map, 0, bitmap_size (free_map), false);
+  for (n = 0; n < leaf_cnt; n++)
+    free_tree[leaf_cnt + n] = leaf_summary (n * LEAF_SECTORS);
+  for (n = leaf_cnt - 1; n >= 1; n--)
+    tree_pull (n, node_len (n));
+}
+
+/* Updates the free tree for a change to the CNT sectors starting
+   at SECTOR. */
+static void
+tree_update (block_sector_t sector, size_t cnt)
+{
+  size_t first = sector / LEAF_SECTORS;
+  size_t last = (sector + cnt - 1) / LEAF_SECTORS;
+  size_t leaf;
+
+  if (cnt == 0)
+    return;
+  for (leaf = first; leaf <= last; leaf++)
+    {
+      size_t n = leaf_cnt + leaf;
+      size_t len = LEAF_SECTORS;
+
+      free_tree[n] = leaf_summary (leaf * LEAF_SECTORS);
+      for (n /= 2, len *= 2; n >= 1; n /= 2, len *= 2)
+        tree_pull (n, len);
+    }
+}
+
+/* Returns the first sector at or after FROM that starts CNT free
+   sectors in a row, searching node NODE of the free tree, which
+   covers sectors LO up to HI, or NO_SECTOR if there is none. */
+static size_t
+tree_search (size_t node, size_t lo, size_t hi, size_t from, size_t cnt)
+{
+  size_t mid, start, r;
+
+  if (hi <= from || free_tree[node].best < cnt)
+    return NO_SECTOR;
+  if (cnt == 0)
+    return from;
+
+  if (node >= leaf_cnt)
+    {
+      size_t run = 0;
+      for (start = lo > from ? lo : from; start < hi; start++)
+        if (start < bitmap_size (free_map) && !bitmap_test (free_map, start))
+          {
+            if (++run == cnt)
+              return start - cnt + 1;
+          }
+        else
+          run = 0;
+      return NO_SECTOR;
+    }
+
+  mid = (lo + hi) / 2;
+  r = tree_search (2 * node, lo, mid, from, cnt);
+  if (r != NO_SECTOR)
+    return r;
+
+  /* A run from the left child into the right one. */
+  start = mid - free_tree[2 * node].suf;
+  if (start < from)
+    start = from;
+  if (start <= mid && mid + free_tree[2 * node + 1].pre - start >= cnt)
+    return start;
+
+  return tree_search (2 * node + 1, mid, hi, from, cnt);
+}
+
+/* Marks the CNT sectors starting at SECTOR as USED or free. */
+static void
+mark (block_sector_t sector, size_t cnt, bool used)
+{
+  bitmap_set_multiple (free_map, sector, cnt, used);
+  tree_update (sector, cnt);
+  if (used)
+    free_cnt -= cnt;
+  else
+    free_cnt += cnt;
+  if (cnt > 0)
+    bitmap_set_multiple (dirty_map, sector / MAP_SECTOR_BITS,
+                         (sector + cnt - 1) / MAP_SECTOR_BITS
+                         - sector / MAP_SECTOR_BITS + 1, true);
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
    the first into *SECTORP.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available. */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  return free_map_allocate_near (cnt, 0, NULL, sectorp);
+}
+
+/* Returns true if CNT sectors may be allocated without taking
+   any that are reserved, other than the *RESERVED of the caller's
+   own reservation if RESERVED is nonnull.  If so, the part of the
+   caller's reservation they use up is taken off it.
+   Caller must hold free_map_lock. */
+static bool
+may_allocate (size_t cnt, size_t *reserved)
+{
+  size_t own = 0;
+
+  if (reserved != NULL)
+    own = cnt < *reserved ? cnt : *reserved;
+  if (cnt > free_cnt || free_cnt - cnt < reserved_cnt - own)
+    return false;
+  if (reserved != NULL)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      reserved_cnt -= own;
+      *reserved -= own;
     }
-  if (sector != BITMAP_ERROR)
+  return true;
+}
+
+/* Allocates CNT consecutive sectors from the free map, the first
+   such run at or after HINT if there is one and otherwise the
+   first one on the disk, and stores the first sector into
+   *SECTORP.  Passing the sector a file's data should follow as
+   HINT keeps the file together.  If RESERVED is nonnull, it
+   points to a reservation made with free_map_reserve() that the
+   sectors may come out of.
+   Returns true if successful, false if not enough consecutive
+   unreserved sectors were available. */
+bool
+free_map_allocate_near (size_t cnt, block_sector_t hint, size_t *reserved,
+                        block_sector_t *sectorp)
+{
+  size_t end = leaf_cnt * LEAF_SECTORS;
+  size_t sector;
+
+  lock_acquire (&free_map_lock);
+  sector = tree_search (1, 0, end, hint, cnt);
+  if (sector == NO_SECTOR && hint > 0)
+    sector = tree_search (1, 0, end, 0, cnt);
+  if (sector != NO_SECTOR && !may_allocate (cnt, reserved))
+    sector = NO_SECTOR;
+  if (sector != NO_SECTOR)
+    mark (sector, cnt, true);
+  lock_release (&free_map_lock);
+  if (sector != NO_SECTOR)
     *sectorp = sector;
-  return sector != BITMAP_ERROR;
+  return sector != NO_SECTOR;
+}
+
+/* Allocates the CNT sectors starting at SECTOR, if they are all
+   free, out of the reservation RESERVED points to if it is
+   nonnull, like free_map_allocate_near().
+   Returns true if successful, false if any of them is in use or
+   not enough unreserved sectors are free. */
+bool
+free_map_allocate_at (block_sector_t sector, size_t cnt, size_t *reserved)
+{
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = (sector + cnt <= bitmap_size (free_map)
+             && bitmap_none (free_map, sector, cnt)
+             && may_allocate (cnt, reserved));
+  if (success)
+    mark (sector, cnt, true);
+  lock_release (&free_map_lock);
+  return success;
 }
 
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  mark (sector, cnt, false);
+  lock_release (&free_map_lock);
+}
+
+/* Reserves CNT free sectors, which other allocations then leave
+   free, to be allocated later against the reservation.
+   Returns false if fewer than CNT unreserved sectors are free. */
+bool
+free_map_reserve (size_t cnt)
+{
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = free_cnt - reserved_cnt >= cnt;
+  if (success)
+    reserved_cnt += cnt;
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Gives back CNT reserved sectors that were not allocated. */
+void
+free_map_unreserve (size_t cnt)
+{
+  lock_acquire (&free_map_lock);
+  ASSERT (reserved_cnt >= cnt);
+  reserved_cnt -= cnt;
+  lock_release (&free_map_lock);
+}
+
+/* Writes the sectors of the free map file that changed since
+   they were last written, each run of adjacent ones at once. */
+void
+free_map_flush (void)
+{
+  size_t start, end;
+
+  lock_acquire (&free_map_lock);
+  if (free_map_file != NULL)
+    for (start = 0;
+         (start = bitmap_scan (dirty_map, start, 1, true)) != BITMAP_ERROR;
+         start = end)
+      {
+        size_t first = start * MAP_SECTOR_BITS;
+        size_t last;
+
+        for (end = start + 1; end < bitmap_size (dirty_map)
+               && bitmap_test (dirty_map, end); end++)
+          continue;
+        last = end * MAP_SECTOR_BITS;
+        if (last > bitmap_size (free_map))
+          last = bitmap_size (free_map);
+        if (bitmap_write_range (free_map, free_map_file, first, last - first))
+          bitmap_set_multiple (dirty_map, start, end - start, false);
+      }
+  lock_release (&free_map_lock);
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -58,13 +389,19 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  tree_build ();
+  bitmap_set_all (dirty_map, false);
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void) 
 {
+  free_map_flush ();
+  lock_acquire (&free_map_lock);
   file_close (free_map_file);
+  free_map_file = NULL;
+  lock_release (&free_map_lock);
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -82,4 +419,5 @@ free_map_create (void)
     PANIC ("can't open free map");
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
+  bitmap_set_all (dirty_map, false);
 }
@@ -5,21 +5,68 @@
 #include <string.h>
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/buffer_cache.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* A run of consecutive data sectors on disk. */
+struct extent
+  {
+    block_sector_t start;               /* First sector. */
+    uint32_t cnt;                       /* Number of sectors. */
+  };
+
+/* Extents held in the inode itself, and in its overflow block
+   once those are used up. */
+#define INODE_EXTENTS 60
+#define OVERFLOW_EXTENTS (BLOCK_SECTOR_SIZE / sizeof (struct extent))
+#define MAX_EXTENTS (INODE_EXTENTS + OVERFLOW_EXTENTS)
+
+/* Sector numbers in an index block.  Once the extents are used up
+   the file goes on one sector at a time through an indirect block
+   and then a doubly indirect one. */
+#define INDEX_PTRS (BLOCK_SECTOR_SIZE / sizeof (block_sector_t))
+#define MAX_INDEXED (INDEX_PTRS + INDEX_PTRS * INDEX_PTRS)
+
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
 struct inode_disk
   {
-    block_sector_t start;               /* First data sector. */
     off_t length;                       /* File size in bytes. */
     unsigned magic;                     /* Magic number. */
-    uint32_t unused[125];               /* Not used. */
+    uint32_t extent_cnt;                /* Number of extents. */
+    block_sector_t overflow;            /* Block of extents past the
+                                           first INODE_EXTENTS. */
+    uint32_t indexed_cnt;               /* Sectors past the extents. */
+    block_sector_t indirect;            /* Indirect block. */
+    block_sector_t dindirect;           /* Doubly indirect block. */
+    uint32_t unused;                    /* Not used. */
+    struct extent extents[INODE_EXTENTS]; /* Data, in file order. */
   };
 
+/* Read-ahead window bounds, in sectors. */
+#define READ_AHEAD_MIN 4
+#define READ_AHEAD_MAX 32
+
+/* Sector-aligned transfers at least this long bypass the
+   buffer cache for their whole sectors. */
+#define STREAM_MIN_SIZE (32 * BLOCK_SECTOR_SIZE)
+
+/* Most sectors moved by one direct disk transfer. */
+#define STREAM_MAX_SECTORS 64
+
+/* Most sectors of data written past the allocated ones that are
+   held in memory before sectors are allocated for them. */
+#define DELAY_SECTORS 16
+
+/* Most overflow and index blocks that allocating sectors for
+   delayed data can add, reserved along with the data sectors. */
+#define DELAY_META_SECTORS 4
+
 /* Returns the number of sectors to allocate for an inode SIZE
    bytes long. */
 static inline size_t
@@ -36,32 +83,415 @@ struct inode
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
+    struct rwlock rw;                   /* Shared for I/O, exclusive to extend. */
+    off_t ra_next;                      /* Offset a sequential read starts at. */
+    size_t ra_window;                   /* Read-ahead window in sectors. */
+    size_t ra_end;                      /* Sectors below this are queued. */
     struct inode_disk data;             /* Inode content. */
+    off_t length;                       /* File size, with delayed data. */
+    uint8_t *delayed;                   /* DELAY_SECTORS sectors of data
+                                           past the allocated ones. */
+    size_t reserved;                    /* Free map sectors reserved
+                                           for the delayed data. */
+    struct extent overflow[OVERFLOW_EXTENTS]; /* Overflow block. */
+    uint32_t extent_ofs[MAX_EXTENTS + 1]; /* File sector each extent
+                                             starts at, and the
+                                             number of sectors. */
+
+    /* Index blocks in use, read at open and kept up to date here
+       so that no lookup waits on a disk read. */
+    block_sector_t *indirect;
+    block_sector_t *dindirect;
+    block_sector_t *dindirect_blocks[INDEX_PTRS];
   };
 
+static void zero_sectors (block_sector_t, size_t);
+static size_t sector_run (struct inode *, off_t, off_t);
+static void inode_commit (struct inode *, off_t, off_t);
+static void inode_free (struct inode *);
+static uint8_t *delayed_at (struct inode *, off_t);
+
+/* Returns extent I of INODE. */
+static struct extent *
+extent_at (struct inode *inode, size_t i)
+{
+  ASSERT (i < MAX_EXTENTS);
+  return (i < INODE_EXTENTS
+          ? &inode->data.extents[i]
+          : &inode->overflow[i - INODE_EXTENTS]);
+}
+
+/* Returns the number of data sectors mapped by INODE's
+   extents. */
+static size_t
+extent_sectors (const struct inode *inode)
+{
+  return inode->extent_ofs[inode->data.extent_cnt];
+}
+
+/* Returns the number of data sectors allocated to INODE. */
+static size_t
+inode_sectors (const struct inode *inode)
+{
+  return extent_sectors (inode) + inode->data.indexed_cnt;
+}
+
+/* Returns a pointer to the index block entry for the IDXth
+   sector past INODE's extents. */
+static block_sector_t *
+index_entry (struct inode *inode, size_t idx)
+{
+  ASSERT (idx < MAX_INDEXED);
+  if (idx < INDEX_PTRS)
+    return &inode->indirect[idx];
+  idx -= INDEX_PTRS;
+  return &inode->dindirect_blocks[idx / INDEX_PTRS][idx % INDEX_PTRS];
+}
+
+/* Returns a new index block cached in memory, read from SECTOR
+   unless CREATE, in which case it is zeroed.
+   Returns a null pointer if memory allocation fails. */
+static block_sector_t *
+index_load (block_sector_t sector, bool create)
+{
+  block_sector_t *block = calloc (1, BLOCK_SECTOR_SIZE);
+
+  if (block != NULL && !create)
+    bc_read (sector, block, 0, BLOCK_SECTOR_SIZE, 0);
+  return block;
+}
+
+/* Reads the index blocks INODE uses into memory.
+   Returns false if memory allocation fails. */
+static bool
+index_open (struct inode *inode)
+{
+  size_t cnt = inode->data.indexed_cnt;
+  size_t i;
+
+  if (cnt == 0)
+    return true;
+  inode->indirect = index_load (inode->data.indirect, false);
+  if (inode->indirect == NULL)
+    return false;
+  if (cnt <= INDEX_PTRS)
+    return true;
+  inode->dindirect = index_load (inode->data.dindirect, false);
+  if (inode->dindirect == NULL)
+    return false;
+  for (i = 0; i < DIV_ROUND_UP (cnt - INDEX_PTRS, INDEX_PTRS); i++)
+    {
+      inode->dindirect_blocks[i] = index_load (inode->dindirect[i], false);
+      if (inode->dindirect_blocks[i] == NULL)
+        return false;
+    }
+  return true;
+}
+
+/* Frees INODE's cached index blocks. */
+static void
+index_close (struct inode *inode)
+{
+  size_t i;
+
+  for (i = 0; i < INDEX_PTRS; i++)
+    free (inode->dindirect_blocks[i]);
+  free (inode->dindirect);
+  free (inode->indirect);
+}
+
+/* Allocates the index block at *SECTOR and its copy in memory at
+   *BLOCK.
+   Returns false if the disk is full or memory allocation fails. */
+static bool
+index_create (struct inode *inode, block_sector_t *sector,
+              block_sector_t **block)
+{
+  if (!free_map_allocate_near (1, 0, &inode->reserved, sector))
+    return false;
+  *block = index_load (*sector, true);
+  if (*block == NULL)
+    {
+      free_map_release (*sector, 1);
+      return false;
+    }
+  bc_write (*sector, *block, 0, BLOCK_SECTOR_SIZE, 0);
+  return true;
+}
+
+/* Adds SECTOR to the end of INODE's data through its index
+   blocks, allocating them as needed.
+   Returns false if INODE is at its maximum size, or if the disk
+   is full or memory allocation fails. */
+static bool
+index_append (struct inode *inode, block_sector_t sector)
+{
+  struct inode_disk *data = &inode->data;
+  size_t idx = data->indexed_cnt;
+
+  if (idx == MAX_INDEXED)
+    return false;
+  if (idx == 0 && !index_create (inode, &data->indirect, &inode->indirect))
+    return false;
+  if (idx == INDEX_PTRS
+      && !index_create (inode, &data->dindirect, &inode->dindirect))
+    return false;
+  if (idx >= INDEX_PTRS && (idx - INDEX_PTRS) % INDEX_PTRS == 0)
+    {
+      size_t i = (idx - INDEX_PTRS) / INDEX_PTRS;
+      if (!index_create (inode, &inode->dindirect[i],
+                         &inode->dindirect_blocks[i]))
+        {
+          /* indexed_cnt does not cover a doubly indirect block
+             created just above, so it must go too. */
+          if (idx == INDEX_PTRS)
+            {
+              free_map_release (data->dindirect, 1);
+              free (inode->dindirect);
+              inode->dindirect = NULL;
+            }
+          return false;
+        }
+      bc_write (data->dindirect, inode->dindirect, 0, BLOCK_SECTOR_SIZE, 0);
+    }
+
+  *index_entry (inode, idx) = sector;
+  if (idx < INDEX_PTRS)
+    bc_write (data->indirect, inode->indirect, 0, BLOCK_SECTOR_SIZE, 0);
+  else
+    {
+      size_t i = (idx - INDEX_PTRS) / INDEX_PTRS;
+      bc_write (inode->dindirect[i], inode->dindirect_blocks[i],
+                0, BLOCK_SECTOR_SIZE, 0);
+    }
+  data->indexed_cnt++;
+  return true;
+}
+
 /* Returns the block device sector that contains byte offset POS
    within INODE.
-   Returns -1 if INODE does not contain data for a byte at offset
-   POS. */
+   Returns -1 if INODE has no sector allocated for a byte at offset
+   POS, either past end of file or with its allocation delayed. */
 static block_sector_t
-byte_to_sector (const struct inode *inode, off_t pos) 
+byte_to_sector (struct inode *inode, off_t pos) 
 {
+  size_t idx, lo, hi;
+
   ASSERT (inode != NULL);
-  if (pos < inode->data.length)
-    return inode->data.start + pos / BLOCK_SECTOR_SIZE;
-  else
+  idx = pos / BLOCK_SECTOR_SIZE;
+  if (idx >= inode_sectors (inode))
     return -1;
+
+  if (idx >= extent_sectors (inode))
+    return *index_entry (inode, idx - extent_sectors (inode));
+
+  /* Find the last extent starting at or before sector IDX. */
+  lo = 0;
+  hi = inode->data.extent_cnt;
+  while (hi - lo > 1)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (inode->extent_ofs[mid] <= idx)
+        lo = mid;
+      else
+        hi = mid;
+    }
+  return extent_at (inode, lo)->start + (idx - inode->extent_ofs[lo]);
+}
+
+/* Writes INODE's on-disk inode, and its overflow block if used,
+   to the buffer cache. */
+static void
+inode_save (struct inode *inode)
+{
+  bc_write (inode->sector, &inode->data, 0, BLOCK_SECTOR_SIZE, 0);
+  if (inode->data.extent_cnt > INODE_EXTENTS)
+    bc_write (inode->data.overflow, inode->overflow, 0, BLOCK_SECTOR_SIZE, 0);
+}
+
+/* Fills CNT sectors starting at SECTOR with zeros. */
+static void
+zero_sectors (block_sector_t sector, size_t cnt)
+{
+  static char zeros[PGSIZE];
+  size_t i, n;
+
+  for (i = 0; i < cnt; i += n)
+    {
+      n = cnt - i;
+      if (n > PGSIZE / BLOCK_SECTOR_SIZE)
+        n = PGSIZE / BLOCK_SECTOR_SIZE;
+      bc_write_direct (sector + i, n, zeros);
+    }
+}
+
+/* Adds CNT sectors starting at SECTOR to the end of INODE's data,
+   merging them into the last extent if they follow it on disk.
+   Returns false if INODE has no room for another extent, in
+   which case the sectors are not added. */
+static bool
+extent_append (struct inode *inode, block_sector_t sector, size_t cnt)
+{
+  struct inode_disk *data = &inode->data;
+  struct extent *last = (data->extent_cnt > 0
+                         ? extent_at (inode, data->extent_cnt - 1) : NULL);
+
+  if (last == NULL || last->start + last->cnt != sector)
+    {
+      if (data->extent_cnt == MAX_EXTENTS)
+        return false;
+      if (data->extent_cnt == INODE_EXTENTS
+          && !free_map_allocate_near (1, 0, &inode->reserved,
+                                      &data->overflow))
+        return false;
+      last = extent_at (inode, data->extent_cnt++);
+      last->start = sector;
+      last->cnt = 0;
+    }
+  last->cnt += cnt;
+  inode->extent_ofs[data->extent_cnt] = inode->extent_ofs[data->extent_cnt - 1]
+                                        + last->cnt;
+  return true;
+}
+
+/* Adds CNT sectors starting at SECTOR to the end of INODE's data,
+   as an extent while there is room for one and then
+   through the index blocks.
+   Returns false if INODE is full, with the sectors it could not
+   take released. */
+static bool
+data_append (struct inode *inode, block_sector_t sector, size_t cnt)
+{
+  size_t i;
+
+  if (inode->data.indexed_cnt == 0 && extent_append (inode, sector, cnt))
+    return true;
+  for (i = 0; i < cnt; i++)
+    if (!index_append (inode, sector + i))
+      {
+        free_map_release (sector + i, cnt - i);
+        return false;
+      }
+  return true;
+}
+
+/* Returns the last sector of INODE's data, which must have
+   some. */
+static block_sector_t
+last_sector (struct inode *inode)
+{
+  struct extent *last;
+
+  if (inode->data.indexed_cnt > 0)
+    return *index_entry (inode, inode->data.indexed_cnt - 1);
+  last = extent_at (inode, inode->data.extent_cnt - 1);
+  return last->start + last->cnt - 1;
+}
+
+/* Writes INODE's data sectors FIRST up to LAST straight to disk,
+   from BUFFER, or zeros if BUFFER is null. */
+static void
+write_sectors (struct inode *inode, size_t first, size_t last,
+               const uint8_t *buffer)
+{
+  while (first < last)
+    {
+      off_t ofs = first * BLOCK_SECTOR_SIZE;
+      block_sector_t sector = byte_to_sector (inode, ofs);
+      size_t cnt = sector_run (inode, ofs, (last - first) * BLOCK_SECTOR_SIZE);
+
+      if (buffer != NULL)
+        {
+          bc_write_direct (sector, cnt, buffer);
+          buffer += cnt * BLOCK_SECTOR_SIZE;
+        }
+      else
+        zero_sectors (sector, cnt);
+      first += cnt;
+    }
+}
+
+/* Allocates data sectors for INODE until it has SECTORS of them.
+   Sectors right after the last one are taken if free, so that a
+   growing file stays in one run; otherwise the longest free runs
+   that fit are used, each as close after the file's data as the
+   free map has one.
+   The new sectors are not initialized.
+   Returns false if the disk or INODE is full, with whatever was
+   allocated kept by INODE. */
+static bool
+inode_extend (struct inode *inode, size_t sectors)
+{
+  while (inode_sectors (inode) < sectors)
+    {
+      size_t need = sectors - inode_sectors (inode);
+      size_t cnt = need;
+      block_sector_t start, hint;
+
+      if (inode_sectors (inode) > 0)
+        {
+          start = last_sector (inode) + 1;
+          if (free_map_allocate_at (start, need, &inode->reserved))
+            {
+              if (!data_append (inode, start, need))
+                return false;
+              continue;
+            }
+        }
+
+      /* Near the file's data, or its inode for a new file. */
+      hint = (inode_sectors (inode) > 0
+              ? last_sector (inode) + 1 : inode->sector + 1);
+      while (!free_map_allocate_near (cnt, hint, &inode->reserved, &start))
+        if ((cnt /= 2) == 0)
+          return false;
+      if (!data_append (inode, start, cnt))
+        return false;
+    }
+  return true;
+}
+
+/* Releases INODE's data sectors, overflow block and index
+   blocks. */
+static void
+inode_release (struct inode *inode)
+{
+  size_t cnt = inode->data.indexed_cnt;
+  size_t i;
+
+  for (i = 0; i < inode->data.extent_cnt; i++)
+    free_map_release (extent_at (inode, i)->start, extent_at (inode, i)->cnt);
+  if (inode->data.extent_cnt > INODE_EXTENTS)
+    free_map_release (inode->data.overflow, 1);
+
+  for (i = 0; i < cnt; i++)
+    free_map_release (*index_entry (inode, i), 1);
+  if (cnt > 0)
+    free_map_release (inode->data.indirect, 1);
+  if (cnt > INDEX_PTRS)
+    {
+      for (i = 0; i < DIV_ROUND_UP (cnt - INDEX_PTRS, INDEX_PTRS); i++)
+        free_map_release (inode->dindirect[i], 1);
+      free_map_release (inode->data.dindirect, 1);
+    }
 }
 
 /* List of open inodes, so that opening a single inode twice
    returns the same `struct inode'. */
 static struct list open_inodes;
 
+/* Protects open_inodes and the open_cnt, removed and
+   deny_write_cnt members of every inode on it.  inode_write_at()
+   reads deny_write_cnt under the inode's rw lock instead, which
+   inode_deny_write() also holds while raising it. */
+static struct lock open_inodes_lock;
+
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
   list_init (&open_inodes);
+  lock_init (&open_inodes_lock);
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -72,37 +502,31 @@ inode_init (void)
 bool
 inode_create (block_sector_t sector, off_t length)
 {
-  struct inode_disk *disk_inode = NULL;
+  struct inode *inode;
   bool success = false;
 
   ASSERT (length >= 0);
 
   /* If this assertion fails, the inode structure is not exactly
      one sector in size, and you should fix that. */
-  ASSERT (sizeof *disk_inode == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof inode->data == BLOCK_SECTOR_SIZE);
 
-  disk_inode = calloc (1, sizeof *disk_inode);
-  if (disk_inode != NULL)
+  inode = calloc (1, sizeof *inode);
+  if (inode != NULL)
     {
-      size_t sectors = bytes_to_sectors (length);
-      disk_inode->length = length;
-      disk_inode->magic = INODE_MAGIC;
-      if (free_map_allocate (sectors, &disk_inode->start)) 
+      inode->sector = sector;
+      inode->data.length = length;
+      inode->data.magic = INODE_MAGIC;
+      if (inode_extend (inode, bytes_to_sectors (length)))
         {
-          //block_write (fs_device, sector, disk_inode);
-          bc_write (sector, disk_inode, 0, BLOCK_SECTOR_SIZE, 0);
-          if (sectors > 0) 
-            {
-              static char zeros[BLOCK_SECTOR_SIZE];
-              size_t i;
-              
-              for (i = 0; i < sectors; i++) 
-                //block_write (fs_device, disk_inode->start + i, zeros);
-                bc_write (disk_inode->start + i, zeros, 0, BLOCK_SECTOR_SIZE, 0);
-            }
+          write_sectors (inode, 0, inode_sectors (inode), NULL);
+          inode_save (inode);
           success = true; 
         } 
-      free (disk_inode);
+      else
+        inode_release (inode);
+      index_close (inode);
+      free (inode);
     }
   return success;
 }
@@ -115,15 +539,18 @@ inode_open (block_sector_t sector)
 {
   struct list_elem *e;
   struct inode *inode;
+  size_t i;
 
   /* Check whether this inode is already open. */
+  lock_acquire (&open_inodes_lock);
   for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
        e = list_next (e)) 
     {
       inode = list_entry (e, struct inode, elem);
       if (inode->sector == sector) 
         {
-          inode_reopen (inode);
+          inode->open_cnt++;
+          lock_release (&open_inodes_lock);
           return inode; 
         }
     }
@@ -131,16 +558,42 @@ inode_open (block_sector_t sector)
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
-    return NULL;
+    {
+      lock_release (&open_inodes_lock);
+      return NULL;
+    }
 
-  /* Initialize. */
+  /* Initialize.  The data is read with open_inodes_lock held so
+     that a concurrent opener never sees it half loaded. */
   list_push_front (&open_inodes, &inode->elem);
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
+  rwlock_init (&inode->rw);
+  inode->ra_next = 0;
+  inode->ra_window = 0;
+  inode->ra_end = 0;
   //block_read (fs_device, inode->sector, &inode->data);
   bc_read (inode->sector, &inode->data, 0, BLOCK_SECTOR_SIZE, 0);
+  if (inode->data.extent_cnt > INODE_EXTENTS)
+    bc_read (inode->data.overflow, inode->overflow, 0, BLOCK_SECTOR_SIZE, 0);
+  inode->extent_ofs[0] = 0;
+  for (i = 0; i < inode->data.extent_cnt; i++)
+    inode->extent_ofs[i + 1] = inode->extent_ofs[i] + extent_at (inode, i)->cnt;
+  inode->length = inode->data.length;
+  inode->delayed = NULL;
+  inode->reserved = 0;
+  inode->indirect = inode->dindirect = NULL;
+  memset (inode->dindirect_blocks, 0, sizeof inode->dindirect_blocks);
+  if (!index_open (inode))
+    {
+      list_remove (&inode->elem);
+      index_close (inode);
+      free (inode);
+      inode = NULL;
+    }
+  lock_release (&open_inodes_lock);
   return inode;
 }
 
@@ -149,7 +602,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&open_inodes_lock);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+    }
   return inode;
 }
 
@@ -171,21 +628,37 @@ inode_close (struct inode *inode)
     return;
 
   /* Release resources if this was the last opener. */
+  lock_acquire (&open_inodes_lock);
   if (--inode->open_cnt == 0)
     {
       /* Remove from inode list and release lock. */
       list_remove (&inode->elem);
- 
-      /* Deallocate blocks if removed. */
-      if (inode->removed) 
-        {
-          free_map_release (inode->sector, 1);
-          free_map_release (inode->data.start,
-                            bytes_to_sectors (inode->data.length)); 
-        }
+      lock_release (&open_inodes_lock);
+      inode_free (inode);
+    }
+  else
+    lock_release (&open_inodes_lock);
+}
 
-      free (inode); 
+/* Frees INODE, closed by its last opener and taken off the inode
+   list.  If INODE was also a removed inode, frees its blocks, and
+   otherwise allocates sectors for its delayed data. */
+static void
+inode_free (struct inode *inode)
+{
+  if (inode->removed) 
+    {
+      free_map_release (inode->sector, 1);
+      inode_release (inode);
+      if (inode->reserved > 0)
+        free_map_unreserve (inode->reserved);
     }
+  else
+    inode_commit (inode, inode->length, inode->length);
+
+  free (inode->delayed);
+  index_close (inode);
+  free (inode); 
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -194,7 +667,64 @@ void
 inode_remove (struct inode *inode) 
 {
   ASSERT (inode != NULL);
+  lock_acquire (&open_inodes_lock);
   inode->removed = true;
+  lock_release (&open_inodes_lock);
+}
+
+/* Returns how many whole sectors of INODE, starting with the one
+   at sector-aligned OFFSET and lying within the next SIZE bytes,
+   are consecutive on disk, at most STREAM_MAX_SECTORS. */
+static size_t
+sector_run (struct inode *inode, off_t offset, off_t size)
+{
+  block_sector_t first = byte_to_sector (inode, offset);
+  size_t max = size / BLOCK_SECTOR_SIZE;
+  size_t cnt;
+
+  if (max > STREAM_MAX_SECTORS)
+    max = STREAM_MAX_SECTORS;
+  for (cnt = 1; cnt < max; cnt++)
+    if (byte_to_sector (inode, offset + cnt * BLOCK_SECTOR_SIZE)
+        != first + cnt)
+      break;
+  return cnt;
+}
+
+/* Detects sequential reads of INODE ending at END that started
+   at START, and queues up to ra_window sectors after END for the
+   read-ahead thread.  The window doubles on each sequential read
+   and collapses on a seek.  Readers share INODE's lock, so this
+   state is only a hint and is updated without further locking. */
+static void
+read_ahead (struct inode *inode, off_t start, off_t end)
+{
+  size_t first, last;
+
+  if (start == inode->ra_next)
+    inode->ra_window = (inode->ra_window == 0 ? READ_AHEAD_MIN
+                        : inode->ra_window * 2 > READ_AHEAD_MAX ? READ_AHEAD_MAX
+                        : inode->ra_window * 2);
+  else
+    {
+      inode->ra_window = 0;
+      inode->ra_end = 0;
+    }
+  inode->ra_next = end;
+  if (inode->ra_window == 0)
+    return;
+
+  first = DIV_ROUND_UP (end, BLOCK_SECTOR_SIZE);
+  last = first + inode->ra_window;
+  if (last > inode_sectors (inode))
+    last = inode_sectors (inode);
+  if (first < inode->ra_end)
+    first = inode->ra_end;
+
+  for (; first < last; first++)
+    bc_read_ahead (byte_to_sector (inode, first * BLOCK_SECTOR_SIZE));
+  if (last > inode->ra_end)
+    inode->ra_end = last;
 }
 
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
@@ -205,8 +735,9 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t *bounce = NULL;
+  bool streaming = offset % BLOCK_SECTOR_SIZE == 0 && size >= STREAM_MIN_SIZE;
 
+  rwlock_acquire_read (&inode->rw);
   while (size > 0) 
     {
       /* Disk sector to read, starting byte offset within sector. */
@@ -223,52 +754,206 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      // if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-      //   {
-      //     /* Read full sector directly into caller's buffer. */
-      //     block_read (fs_device, sector_idx, buffer + bytes_read);
-      //   }
-      // else 
-      //   {
-      //     /* Read sector into bounce buffer, then partially copy
-      //        into caller's buffer. */
-      //     if (bounce == NULL) 
-      //       {
-      //         bounce = malloc (BLOCK_SECTOR_SIZE);
-      //         if (bounce == NULL)
-      //           break;
-      //       }
-      //     block_read (fs_device, sector_idx, bounce);
-      //     memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
-      //   }
-      /* pj4 */
-      bc_read (sector_idx, buffer, bytes_read, chunk_size, sector_ofs);
+      if (sector_idx == (block_sector_t) -1)
+        memcpy (buffer + bytes_read, delayed_at (inode, offset), chunk_size);
+      else if (streaming && chunk_size == BLOCK_SECTOR_SIZE)
+        {
+          /* Read a run of full sectors directly into caller's
+             buffer. */
+          size_t cnt = sector_run (inode, offset,
+                                   size < inode_left ? size : inode_left);
+          chunk_size = cnt * BLOCK_SECTOR_SIZE;
+          bc_read_direct (sector_idx, cnt, buffer + bytes_read);
+        }
+      else
+        bc_read (sector_idx, buffer, bytes_read, chunk_size, sector_ofs);
 
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
     }
-  //free (bounce);
+  if (!streaming)
+    read_ahead (inode, offset - bytes_read, offset);
+  rwlock_release_read (&inode->rw);
 
   return bytes_read;
 }
 
+/* Allocates sectors for INODE's data up to LENGTH bytes, which is
+   at least its length, writing its delayed data to the first of
+   them and zeros to the rest, and makes LENGTH its length.  The
+   caller is about to write the bytes from OFS up to LENGTH, so
+   the sectors that write fills completely are not zeroed.  All
+   the sectors are asked for at once, so that data appended in
+   small writes still lands in one run.  Sectors come out of
+   INODE's reservation first, and what is left of it is given
+   back.  If the disk fills up anyway, which the reservation
+   prevents for delayed data, the file is cut short at the last
+   sector allocated.  Must be called with INODE's lock held
+   exclusively, or by its last closer. */
+static void
+inode_commit (struct inode *inode, off_t length, off_t ofs)
+{
+  size_t first = inode_sectors (inode);
+  size_t delayed = bytes_to_sectors (inode->length) - first;
+  size_t last, start, fill_first, fill_last;
+
+  if (first < bytes_to_sectors (length)
+      && !inode_extend (inode, bytes_to_sectors (length))
+      && length > (off_t) inode_sectors (inode) * BLOCK_SECTOR_SIZE)
+    length = inode_sectors (inode) * BLOCK_SECTOR_SIZE;
+
+  last = inode_sectors (inode);
+  if (delayed > last - first)
+    delayed = last - first;
+  start = first + delayed;
+  write_sectors (inode, first, start, inode->delayed);
+
+  /* Zero the new sectors before OFS and from the last whole
+     sector up to LENGTH on, which the write only partly covers. */
+  fill_first = DIV_ROUND_UP (ofs, BLOCK_SECTOR_SIZE);
+  fill_last = length / BLOCK_SECTOR_SIZE;
+  if (fill_first >= fill_last)
+    fill_first = fill_last = last;
+  write_sectors (inode, start, fill_first < last ? fill_first : last, NULL);
+  write_sectors (inode, fill_last > start ? fill_last : start, last, NULL);
+  if (inode->delayed != NULL)
+    memset (inode->delayed, 0, DELAY_SECTORS * BLOCK_SECTOR_SIZE);
+
+  if (inode->reserved > 0)
+    {
+      free_map_unreserve (inode->reserved);
+      inode->reserved = 0;
+    }
+
+  inode->length = length;
+  if (inode->data.length != length)
+    {
+      inode->data.length = length;
+      inode_save (inode);
+    }
+}
+
+/* Extends INODE to LENGTH bytes, for a write of the bytes from OFS
+   up to LENGTH.  Data past the allocated sectors is kept in
+   memory, and sectors are allocated for it only once it outgrows
+   DELAY_SECTORS, or when it is flushed or INODE is closed.  Enough sectors for it are reserved in the free map
+   meanwhile, and if they cannot be, they are allocated at once,
+   so that a full disk shortens the write that grew INODE rather
+   than the file later on.  Must be called with INODE's lock held
+   exclusively. */
+static void
+inode_grow (struct inode *inode, off_t ofs, off_t length)
+{
+  size_t need = (bytes_to_sectors (length) - inode_sectors (inode)
+                 + DELAY_META_SECTORS);
+
+  if (bytes_to_sectors (length) - inode_sectors (inode) > DELAY_SECTORS)
+    {
+      inode_commit (inode, length, ofs);
+      return;
+    }
+  if (inode->delayed == NULL)
+    {
+      inode->delayed = calloc (DELAY_SECTORS, BLOCK_SECTOR_SIZE);
+      if (inode->delayed == NULL)
+        {
+          inode_commit (inode, length, ofs);
+          return;
+        }
+    }
+  if (need > inode->reserved)
+    {
+      if (!free_map_reserve (need - inode->reserved))
+        {
+          inode_commit (inode, length, ofs);
+          return;
+        }
+      inode->reserved = need;
+    }
+  inode->length = length;
+}
+
+/* Returns the delayed data of INODE at byte offset POS, which must
+   be past its allocated sectors. */
+static uint8_t *
+delayed_at (struct inode *inode, off_t pos)
+{
+  size_t idx = pos / BLOCK_SECTOR_SIZE - inode_sectors (inode);
+
+  ASSERT (idx < DELAY_SECTORS);
+  return inode->delayed + idx * BLOCK_SECTOR_SIZE + pos % BLOCK_SECTOR_SIZE;
+}
+
+/* Allocates sectors for the delayed data of every open inode, so
+   that the flush daemon can write it out. */
+void
+inode_flush_delayed (void)
+{
+  struct list_elem *e;
+
+  lock_acquire (&open_inodes_lock);
+  e = list_begin (&open_inodes);
+  while (e != list_end (&open_inodes))
+    {
+      struct inode *inode = list_entry (e, struct inode, elem);
+
+      if (inode->length == inode->data.length || inode->removed)
+        {
+          e = list_next (e);
+          continue;
+        }
+
+      /* Keep INODE open while it is committed without
+         open_inodes_lock held, then start over, since the list
+         may have changed meanwhile. */
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+      rwlock_acquire_write (&inode->rw);
+      inode_commit (inode, inode->length, inode->length);
+      rwlock_release_write (&inode->rw);
+
+      lock_acquire (&open_inodes_lock);
+      if (--inode->open_cnt == 0)
+        {
+          list_remove (&inode->elem);
+          lock_release (&open_inodes_lock);
+          inode_free (inode);
+          lock_acquire (&open_inodes_lock);
+        }
+      e = list_begin (&open_inodes);
+    }
+  lock_release (&open_inodes_lock);
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   less than SIZE if an error occurs.  A write past end of file
+   extends the inode, or writes less than SIZE if the disk is
+   full. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset) 
 {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
+  bool streaming = offset % BLOCK_SECTOR_SIZE == 0 && size >= STREAM_MIN_SIZE;
+  bool extending;
+
+  /* Writes inside the file only share the inode, since the
+     buffer cache orders accesses to each sector; a write past
+     end of file changes the length and must be alone. */
+  extending = offset + size > inode_length (inode);
+  if (extending)
+    rwlock_acquire_write (&inode->rw);
+  else
+    rwlock_acquire_read (&inode->rw);
 
   if (inode->deny_write_cnt)
-    return 0;
+    size = 0;
+  else if (extending && offset + size > inode_length (inode))
+    inode_grow (inode, offset, offset + size);
 
   while (size > 0) 
     {
@@ -286,51 +971,44 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       if (chunk_size <= 0)
         break;
 
-      // if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-      //   {
-      //     /* Write full sector directly to disk. */
-      //     block_write (fs_device, sector_idx, buffer + bytes_written);
-      //   }
-      // else 
-      //   {
-      //     /* We need a bounce buffer. */
-      //     if (bounce == NULL) 
-      //       {
-      //         bounce = malloc (BLOCK_SECTOR_SIZE);
-      //         if (bounce == NULL)
-      //           break;
-      //       }
-
-      //     /* If the sector contains data before or after the chunk
-      //        we're writing, then we need to read in the sector
-      //        first.  Otherwise we start with a sector of all zeros. */
-      //     if (sector_ofs > 0 || chunk_size < sector_left) 
-      //       block_read (fs_device, sector_idx, bounce);
-      //     else
-      //       memset (bounce, 0, BLOCK_SECTOR_SIZE);
-      //     memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-      //     block_write (fs_device, sector_idx, bounce);
-      //   }
-      /* pj4 */
-      bc_write (sector_idx, buffer, bytes_written, chunk_size, sector_ofs);
+      if (sector_idx == (block_sector_t) -1)
+        memcpy (delayed_at (inode, offset), buffer + bytes_written, chunk_size);
+      else if (streaming && chunk_size == BLOCK_SECTOR_SIZE)
+        {
+          /* Write a run of full sectors directly to disk. */
+          size_t cnt = sector_run (inode, offset,
+                                   size < inode_left ? size : inode_left);
+          chunk_size = cnt * BLOCK_SECTOR_SIZE;
+          bc_write_direct (sector_idx, cnt, buffer + bytes_written);
+        }
+      else
+        bc_write (sector_idx, buffer, bytes_written, chunk_size, sector_ofs);
 
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_written += chunk_size;
     }
-  free (bounce);
+
+  if (extending)
+    rwlock_release_write (&inode->rw);
+  else
+    rwlock_release_read (&inode->rw);
 
   return bytes_written;
 }
 
-/* Disables writes to INODE.
+/* Disables writes to INODE, waiting for writes in progress.
    May be called at most once per inode opener. */
 void
 inode_deny_write (struct inode *inode) 
 {
+  rwlock_acquire_write (&inode->rw);
+  lock_acquire (&open_inodes_lock);
   inode->deny_write_cnt++;
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
+  lock_release (&open_inodes_lock);
+  rwlock_release_write (&inode->rw);
 }
 
 /* Re-enables writes to INODE.
@@ -339,14 +1017,29 @@ inode_deny_write (struct inode *inode)
 void
 inode_allow_write (struct inode *inode) 
 {
+  lock_acquire (&open_inodes_lock);
   ASSERT (inode->deny_write_cnt > 0);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
   inode->deny_write_cnt--;
+  lock_release (&open_inodes_lock);
+}
+
+/* Returns the disk sector that holds byte offset POS of INODE,
+   or -1 if there is none, as for delayed data. */
+block_sector_t
+inode_sector_at (struct inode *inode, off_t pos)
+{
+  block_sector_t sector;
+
+  rwlock_acquire_read (&inode->rw);
+  sector = byte_to_sector (inode, pos);
+  rwlock_release_read (&inode->rw);
+  return sector;
 }
 
 /* Returns the length, in bytes, of INODE's data. */
 off_t
 inode_length (const struct inode *inode)
 {
-  return inode->data.length;
+  return inode->length;
 }
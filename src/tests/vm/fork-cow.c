@@ -0,0 +1,64 @@
+/* Forks a child and checks that writes to copy-on-write pages
+   made by either process after the fork stay invisible to the
+   other one. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SIZE 4096
+
+static char child_buf[SIZE];
+static char parent_buf[SIZE];
+
+/* Fails unless all SIZE bytes of BUF are C. */
+static void
+check_fill (const char *buf, char c, const char *who)
+{
+  size_t i;
+
+  for (i = 0; i < SIZE; i++)
+    if (buf[i] != c)
+      fail ("%s: byte %zu is '%c' (should be '%c')", who, i, buf[i], c);
+}
+
+void
+test_main (void)
+{
+  pid_t child;
+  int handle;
+
+  memset (child_buf, 'a', SIZE);
+  memset (parent_buf, 'a', SIZE);
+
+  msg ("fork");
+  child = fork ();
+  if (child == 0)
+    {
+      memset (child_buf, 'c', SIZE);
+
+      /* Wait until the parent has written its page. */
+      while ((handle = open ("ready")) == -1)
+        continue;
+      close (handle);
+
+      check_fill (parent_buf, 'a', "child");
+      check_fill (child_buf, 'c', "child");
+      msg ("child sees only its own writes");
+      exit (81);
+    }
+  if (child == -1)
+    fail ("fork");
+
+  memset (parent_buf, 'p', SIZE);
+  if (!create ("ready", 0))
+    fail ("create \"ready\"");
+  quiet = true;
+  CHECK (wait (child) == 81, "wait for child");
+  quiet = false;
+
+  check_fill (child_buf, 'a', "parent");
+  check_fill (parent_buf, 'p', "parent");
+  msg ("parent sees only its own writes");
+}
@@ -0,0 +1,14 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(fork-cow) begin
+(fork-cow) fork
+(fork-cow) child sees only its own writes
+fork-cow: exit(81)
+(fork-cow) parent sees only its own writes
+(fork-cow) end
+fork-cow: exit(0)
+EOF
+pass;
@@ -0,0 +1,45 @@
+/* Opens a file, reads part of it, and forks.  The child must
+   inherit the open file at the same position and read the rest
+   of it, without disturbing the parent's own handle. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/vm/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define HEAD 16
+
+void
+test_main (void)
+{
+  char buf[sizeof sample];
+  size_t rest = strlen (sample) - HEAD;
+  int handle;
+  pid_t child;
+
+  CHECK ((handle = open ("sample.txt")) > 1, "open \"sample.txt\"");
+  CHECK (read (handle, buf, HEAD) == HEAD, "read first %d bytes", HEAD);
+
+  child = fork ();
+  if (child == 0)
+    {
+      if (read (handle, buf, rest) != (int) rest)
+        fail ("child: read of inherited fd came up short");
+      if (memcmp (buf, sample + HEAD, rest))
+        fail ("child: inherited fd read bad data");
+      close (handle);
+      exit (0);
+    }
+  if (child == -1)
+    fail ("fork");
+  quiet = true;
+  CHECK (wait (child) == 0, "wait for child");
+  quiet = false;
+
+  CHECK (read (handle, buf, rest) == (int) rest,
+         "read rest of \"sample.txt\" in parent");
+  if (memcmp (buf, sample + HEAD, rest))
+    fail ("parent: read bad data after child closed its fd");
+  close (handle);
+}
@@ -0,0 +1,14 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(fork-fd) begin
+(fork-fd) open "sample.txt"
+(fork-fd) read first 16 bytes
+fork-fd: exit(0)
+(fork-fd) read rest of "sample.txt" in parent
+(fork-fd) end
+fork-fd: exit(0)
+EOF
+pass;
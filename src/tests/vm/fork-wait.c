@@ -0,0 +1,20 @@
+/* Forks a child that exits with a known status, then waits for
+   it twice: the first wait returns the status, the second -1. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void)
+{
+  pid_t child;
+
+  child = fork ();
+  if (child == 0)
+    exit (42);
+  if (child == -1)
+    fail ("fork");
+  msg ("wait(fork()) = %d", wait (child));
+  msg ("wait again = %d", wait (child));
+}
@@ -36,8 +36,11 @@
 #include "devices/ide.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
+#include "filesys/buffer_cache.h"
 #endif
 #include "vm/frame.h"
+#include "vm/share.h"
+#include "vm/swap.h"
 
 /* Page directory with kernel mappings only. */
 uint32_t *init_page_dir;
@@ -129,9 +132,11 @@ main (void)
   filesys_init (format_filesys);
 #endif
   lru_list_init ();
+  share_init ();
   
   /* pj3 swap */
   swap_init ();
+  pageout_init ();
 
 
   printf ("Boot complete.\n");
@@ -254,6 +259,12 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-bc"))
+        bc_configure (atoi (value));
+      else if (!strcmp (name, "-bcflush"))
+        bc_configure_flush (atoi (value));
+      else if (!strcmp (name, "-bcdirty"))
+        bc_configure_dirty (atoi (value));
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -266,6 +277,13 @@ parse_options (char **argv)
 #ifdef USERPROG
       else if (!strcmp (name, "-ul"))
         user_page_limit = atoi (value);
+#endif
+#ifdef VM
+      else if (!strcmp (name, "-evict"))
+        {
+          if (!evict_policy_set (value))
+            PANIC ("unknown eviction policy `%s' (use -h for help)", value);
+        }
 #endif
       else
         PANIC ("unknown option `%s' (use -h for help)", name);
@@ -380,6 +398,9 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -bc=PAGES          Use PAGES user pages for the buffer cache.\n"
+          "  -bcflush=MS        Write back dirty cache sectors every MS ms.\n"
+          "  -bcdirty=PERCENT   Write back early once PERCENT of cache is dirty.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
@@ -388,6 +409,9 @@ usage (void)
           "  -mlfqs             Use multi-level feedback queue scheduler.\n"
 #ifdef USERPROG
           "  -ul=COUNT          Limit user memory to COUNT pages.\n"
+#endif
+#ifdef VM
+          "  -evict=POLICY      Evict frames by POLICY: fifo, clock or esc.\n"
 #endif
           );
   shutdown_power_off ();
@@ -116,6 +116,10 @@ struct thread
     struct list mmap_list;
     int next_mapid;
     int *esp;                     
+    struct vm_entry *vme_hint;          /* last vme found by find_vme */
+    size_t fa_window;                   /* fault-around window in pages */
+    uint8_t *fa_start;                  /* first page of last fault-around */
+    size_t fa_cnt;                      /* pages mapped by last fault-around */
     // struct file *file;
   };
 
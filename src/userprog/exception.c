@@ -164,6 +164,24 @@ page_fault (struct intr_frame *f)
   write = (f->error_code & PF_W) != 0;
   user = (f->error_code & PF_U) != 0;
 
+  /* a write to a page mapped read-only from a shared frame gets
+     its own copy of the frame.  Any other write to a present page,
+     or a write to a page that is not writable, is a violation. */
+  if (write)
+  {
+    vme = find_vme (fault_addr);
+    if (!not_present)
+    {
+      if (vme == NULL || !vme->cow || !vme->writable)
+        exit (-1);
+      if (!handle_cow_fault (vme))
+        exit (-1);
+      return;
+    }
+    if (vme != NULL && !vme->writable)
+      exit (-1);
+  }
+
   if (!user && !not_present)
   {
       f->eip = (void (*) (void)) f->eax;
@@ -179,7 +197,7 @@ page_fault (struct intr_frame *f)
   {
 
    if (check_stack_status (fault_addr, esp))
-      stack_growth (fault_addr);
+      stack_growth (fault_addr, write);
    else
       exit (-1);
 
@@ -187,7 +205,7 @@ page_fault (struct intr_frame *f)
   }
 
   /* found then handle each cases */
-  if (!handle_mm_fault (vme))
+  if (!handle_mm_fault (vme, write))
     exit(-1);
 
 /*====================================================*/
@@ -6,7 +6,11 @@
 #define PF_W 0x2    /* 0: read, 1: write. */
 #define PF_U 0x4    /* 0: kernel, 1: user process. */
 
+#include <stdbool.h>
+#include <stdint.h>
+
 void exception_init (void);
 void exception_print_stats (void);
+bool check_stack_status (int32_t fault_addr, int32_t esp);
 
 #endif /* userprog/exception.h */
\ No newline at end of file
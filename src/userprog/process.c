@@ -8,9 +8,11 @@
 #include "userprog/gdt.h"
 #include "userprog/pagedir.h"
 #include "userprog/tss.h"
+#include "filesys/buffer_cache.h"
 #include "filesys/directory.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
+#include "filesys/inode.h"
 #include "threads/flags.h"
 #include "threads/init.h"
 #include "threads/interrupt.h"
@@ -18,11 +20,24 @@
 #include "threads/thread.h"
 #include "threads/vaddr.h"
 #include "vm/page.h"
+#include "vm/frame.h"
+#include "vm/swap.h"
+#include "vm/share.h"
 #include "userprog/syscall.h"
 
 
+/* pj3 : fault-around window bounds, in pages */
+#define FAULT_AROUND_MIN 1
+#define FAULT_AROUND_INIT 4
+#define FAULT_AROUND_MAX 16
+
+/* pj3 : most pages swapped in after the faulting one */
+#define SWAP_AROUND 4
+
 static thread_func start_process NO_RETURN;
+static thread_func start_fork NO_RETURN;
 static bool load (const char *cmdline, void (**eip) (void), void **esp);
+static bool install_page (void *upage, void *kpage, bool writable);
 
 /* Starts a new thread running a user program loaded from
    FILENAME.  The new thread may be scheduled (and may even exit)
@@ -55,6 +70,156 @@ process_execute (const char *file_name)
   return tid;
 }
 
+/* pj3 : what a forked child is started from */
+struct fork_info
+{
+  struct thread *parent;
+  struct intr_frame if_;        /* parent's user context at fork */
+  struct semaphore done;        /* up once the child is set up */
+  bool success;
+};
+
+static bool fork_vm (struct thread *parent);
+static bool fork_files (struct thread *parent);
+
+/* pj3 : start a child process running a copy of the current one,
+   which returns from the system call with frame F like the parent
+   does.  Pages are shared copy-on-write rather than copied.
+   Returns the child's tid, or TID_ERROR if it could not be set
+   up. */
+tid_t
+process_fork (struct intr_frame *f)
+{
+  struct fork_info info;
+  tid_t tid;
+
+  info.parent = thread_current ();
+  info.if_ = *f;
+  sema_init (&info.done, 0);
+  info.success = false;
+
+  tid = thread_create (thread_name (), PRI_DEFAULT, start_fork, &info);
+  if (tid == TID_ERROR)
+    return TID_ERROR;
+  sema_down (&info.done);
+  if (!info.success)
+  {
+    process_wait (tid);
+    return TID_ERROR;
+  }
+  return tid;
+}
+
+/* pj3 : thread function of a forked child.  Copies the parent's
+   address space and files, then returns to user mode where the
+   parent made the fork call, with 0 as the result. */
+static void
+start_fork (void *info_)
+{
+  struct fork_info *info = info_;
+  struct thread *t = thread_current ();
+  struct intr_frame if_ = info->if_;
+  bool success = false;
+
+  vm_init (&t->vm);
+  t->fa_window = FAULT_AROUND_INIT;
+  t->fa_cnt = 0;
+
+  t->pagedir = pagedir_create ();
+  if (t->pagedir != NULL)
+  {
+    process_activate ();
+    success = fork_vm (info->parent) && fork_files (info->parent);
+  }
+
+  /* the parent, and INFO with it, may be gone after this */
+  info->success = success;
+  sema_up (&info->done);
+  if (!success)
+    thread_exit ();
+
+  if_.eax = 0;
+  asm volatile ("movl %0, %%esp; jmp intr_exit" : : "g" (&if_) : "memory");
+  NOT_REACHED ();
+}
+
+/* pj3 : copy every vm entry of PARENT into the current process.
+   Loaded pages are shared with the parent, and pages in swap are
+   read into frames of the child's own, since swap slots belong to
+   one vm entry.  Memory mapped files are not inherited. */
+static bool
+fork_vm (struct thread *parent)
+{
+  struct thread *t = thread_current ();
+  struct hash_iterator i;
+
+  hash_first (&i, &parent->vm);
+  while (hash_next (&i))
+  {
+    struct vm_entry *pvme = hash_entry (hash_cur (&i), struct vm_entry, elem);
+    struct vm_entry *cvme;
+    struct page *kpage;
+
+    if (pvme->type == VM_FILE)
+      continue;
+
+    cvme = (struct vm_entry *) malloc (sizeof (struct vm_entry));
+    if (! cvme)
+      return false;
+    memcpy (cvme, pvme, sizeof *cvme);
+    cvme->is_loaded = false;
+    cvme->cow = false;
+    cvme->share = NULL;
+    cvme->thread = NULL;
+    cvme->swap_slot = SWAP_SLOT_NONE;
+    insert_vme (&t->vm, cvme);
+
+    if (!share_fork (parent, pvme, cvme))
+      return false;
+    if (cvme->is_loaded)
+      continue;
+
+    /* evicted meanwhile, maybe turned from VM_BIN to VM_ANON */
+    cvme->type = pvme->type;
+    if (pvme->type != VM_ANON || pvme->swap_slot == SWAP_SLOT_NONE)
+      continue;
+
+    kpage = alloc_page (PAL_USER);
+    if (! kpage)
+      return false;
+    swap_in (pvme->swap_slot, kpage->kaddr);
+    if (!install_page (cvme->vaddr, kpage->kaddr, cvme->writable))
+    {
+      free_page (kpage->kaddr);
+      return false;
+    }
+    kpage->vme = cvme;
+    cvme->is_loaded = true;
+    lru_list_insert (kpage);
+  }
+  return true;
+}
+
+/* pj3 : open every file PARENT has open at the same descriptor in
+   the current process, at the same position */
+static bool
+fork_files (struct thread *parent)
+{
+  struct thread *t = thread_current ();
+  int fd;
+
+  for (fd = 0; fd < 64; fd++)
+  {
+    if (parent->file_fdt[fd] == NULL)
+      continue;
+    t->file_fdt[fd] = file_reopen (parent->file_fdt[fd]);
+    if (t->file_fdt[fd] == NULL)
+      return false;
+    file_seek (t->file_fdt[fd], file_tell (parent->file_fdt[fd]));
+  }
+  return true;
+}
+
 /* pj2 */
 /* get cmd name from file name */
 char *
@@ -92,6 +257,8 @@ start_process (void *file_name_)
   /* pj3 */
   /* hash table initialize */
   vm_init (&thread_current ()->vm);
+  thread_current ()->fa_window = FAULT_AROUND_INIT;
+  thread_current ()->fa_cnt = 0;
 
   /* Initialize interrupt frame and load executable. */
   memset (&if_, 0, sizeof if_);
@@ -216,6 +383,11 @@ process_exit (void)
   struct thread *cur = thread_current ();
   uint32_t *pd;
 
+  /* pj3 */
+  /* when process exit destroy hash table, freeing loaded frames
+     while the page directory still maps them */
+  vm_destroy (& (cur->vm));
+
   /* Destroy the current process's page directory and switch back
      to the kernel-only page directory. */
   pd = cur->pagedir;
@@ -242,10 +414,6 @@ process_exit (void)
   //     do_munmap(mmap_file);
   // }
 
-  /* pj3 */
-  /* when process exit destroy hash table */
-  vm_destroy (& (cur->vm));
-
   sema_up (& (cur->sema_child));
   sema_down (& (cur->sema_mem));
 }
@@ -330,6 +498,8 @@ struct Elf32_Phdr
 #define PF_R 4          /* Readable. */
 
 static bool setup_stack (void **esp);
+static void fault_around (struct vm_entry *vme);
+static void swap_around (struct vm_entry *vme);
 static bool validate_segment (const struct Elf32_Phdr *, struct file *);
 static bool load_segment (struct file *file, off_t ofs, uint8_t *upage,
                           uint32_t read_bytes, uint32_t zero_bytes,
@@ -455,7 +625,6 @@ load (const char *file_name, void (**eip) (void), void **esp)
 
 /* load() helpers. */
 
-static bool install_page (void *upage, void *kpage, bool writable);
 
 /* Checks whether PHDR describes a valid, loadable segment in
    FILE and returns true if so, false otherwise. */
@@ -543,6 +712,10 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
       vme->offset = ofs;
       vme->read_bytes = page_read_bytes;
       vme->zero_bytes = page_zero_bytes;
+      vme->is_loaded = false;
+      vme->cow = false;
+      vme->share = NULL;
+      vme->swap_slot = SWAP_SLOT_NONE;
 
       insert_vme (&thread_current ()->vm, vme);
       
@@ -606,6 +779,9 @@ setup_stack (void **esp)
   vme->vaddr = (uint8_t *) PHYS_BASE - PGSIZE;
   vme->writable = true;
   vme->is_loaded = true;
+  vme->cow = false;
+  vme->share = NULL;
+  vme->swap_slot = SWAP_SLOT_NONE;
 
   kpage->vme = vme;
 
@@ -634,16 +810,51 @@ install_page (void *upage, void *kpage, bool writable)
           && pagedir_set_page (t->pagedir, upage, kpage, writable));
 }
 
-/* pj3 : handle cases for page fault */
+/* pj3 : true if VME is a page of zeros that has never been
+   written, either all bss or a new stack page */
+static bool
+is_zero_page (struct vm_entry *vme)
+{
+  return (vme->type == VM_BIN && vme->read_bytes == 0)
+         || (vme->type == VM_ANON && vme->swap_slot == SWAP_SLOT_NONE);
+}
+
+/* pj3 : handle cases for page fault.  WRITE is true if the
+   faulting access was a write. */
 bool
-handle_mm_fault (struct vm_entry *vme)
+handle_mm_fault (struct vm_entry *vme, bool write)
 {
   bool success = false;
-  struct page *kpage = alloc_page (PAL_USER);
-  kpage->vme = vme;
+  struct page *kpage;
+
+  /* a page still loaded but not mapped is being evicted, and is
+     loaded again once it has been written back */
+  if (vme->is_loaded
+      && pagedir_get_page (thread_current ()->pagedir, vme->vaddr) == NULL)
+    evict_wait (vme);
 
+  /* reading a page of zeros maps the shared zero frame, and the
+     page gets a frame of its own only when it is first written */
+  if (!write && is_zero_page (vme))
+  {
+    if (!install_page (vme->vaddr, frame_zero (), false))
+      return false;
+    vme->cow = true;
+    vme->is_loaded = true;
+    return true;
+  }
+
+  /* text another process already has in memory is mapped from it */
+  if (share_ok (vme) && share_map (vme))
+  {
+    fault_around (vme);
+    return true;
+  }
+
+  kpage = alloc_page (PAL_USER);
   if (! kpage)
     return false;
+  kpage->vme = vme;
 
   /* handle for each case */
   switch (vme->type)
@@ -658,7 +869,10 @@ handle_mm_fault (struct vm_entry *vme)
       break;
 
     case VM_ANON:
-      swap_in (vme->swap_slot, kpage->kaddr);
+      if (vme->swap_slot == SWAP_SLOT_NONE)
+        memset (kpage->kaddr, 0, PGSIZE);
+      else
+        swap_in (vme->swap_slot, kpage->kaddr);
       success = true;
       break;
     
@@ -667,38 +881,177 @@ handle_mm_fault (struct vm_entry *vme)
   }
   install_page (vme->vaddr, kpage->kaddr, vme->writable);
   vme->is_loaded = true;
+  if (success && share_ok (vme))
+    share_add (kpage);
   lru_list_insert (kpage);
+
+  if (success && (vme->type == VM_BIN || vme->type == VM_FILE))
+    fault_around (vme);
+  else if (success && vme->type == VM_ANON
+           && vme->swap_slot != SWAP_SLOT_NONE)
+    swap_around (vme);
   return success;
 }
 
-/* pj3 : expand stack for page fault */
-void
-stack_growth (void *addr)
+/* pj3 : write fault on VME, mapped read-only to a shared frame.
+   Give it a private copy of the frame, mapped writable, unless no
+   other process maps the frame any more. */
+bool
+handle_cow_fault (struct vm_entry *vme)
 {
-
   struct page *kpage;
+
+  if (share_claim (vme))
+    return true;
+
+  kpage = alloc_page (PAL_USER);
+  if (! kpage)
+    return false;
+  if (!share_copy (vme, kpage->kaddr))
+  {
+    free_page (kpage->kaddr);
+    return true;
+  }
+  kpage->vme = vme;
+  lru_list_insert (kpage);
+  return true;
+}
+
+/* pj3 : after swapping in VME, also swap in this process's pages
+   in the slots right after its own, which were most likely evicted
+   in the same batch, up to SWAP_AROUND of them.  Only free frames
+   are used.  The pages keep their slots, so if they go unused they
+   are evicted again without a write. */
+static void
+swap_around (struct vm_entry *vme)
+{
+  struct vm_entry *next[SWAP_AROUND];
+  struct page *kpages[SWAP_AROUND];
+  void *kaddrs[SWAP_AROUND];
+  size_t slots[SWAP_AROUND];
+  size_t cnt, n, i;
+
+  cnt = swap_neighbors (vme->swap_slot, next, SWAP_AROUND);
+  for (n = 0; n < cnt; n++)
+  {
+    kpages[n] = try_alloc_page (PAL_USER);
+    if (kpages[n] == NULL)
+      break;
+    kaddrs[n] = kpages[n]->kaddr;
+    slots[n] = next[n]->swap_slot;
+  }
+  swap_in_batch (slots, kaddrs, n);
+
+  for (i = 0; i < n; i++)
+  {
+    if (!install_page (next[i]->vaddr, kaddrs[i], next[i]->writable))
+    {
+      free_page (kaddrs[i]);
+      continue;
+    }
+    kpages[i]->vme = next[i];
+    next[i]->is_loaded = true;
+    lru_list_insert (kpages[i]);
+  }
+}
+
+/* pj3 : after a fault on file-backed VME, also map the pages that
+   follow it in the same file, up to fa_window of them.  The window
+   stops at the first page that would cost a seek to load: one
+   whose first sector is neither in the buffer cache nor right
+   after the first sector of the page before it on disk.
+   Only free frames are used, never evicting for a guess.  The
+   window doubles when most pages mapped last time were accessed
+   since, and halves when none were. */
+static void
+fault_around (struct vm_entry *vme)
+{
+  struct thread *t = thread_current ();
+  struct inode *inode = file_get_inode (vme->file);
+  block_sector_t prev = inode_sector_at (inode, vme->offset);
+  size_t used = 0, i;
+
+  if (t->fa_cnt > 0)
+  {
+    for (i = 0; i < t->fa_cnt; i++)
+      if (pagedir_is_accessed (t->pagedir, t->fa_start + i * PGSIZE))
+        used++;
+    if (used * 2 >= t->fa_cnt)
+      t->fa_window = (t->fa_window * 2 > FAULT_AROUND_MAX
+                      ? FAULT_AROUND_MAX : t->fa_window * 2);
+    else if (used == 0)
+      t->fa_window = (t->fa_window / 2 < FAULT_AROUND_MIN
+                      ? FAULT_AROUND_MIN : t->fa_window / 2);
+  }
+
+  t->fa_start = (uint8_t *) vme->vaddr + PGSIZE;
+  t->fa_cnt = 0;
+  for (i = 0; i < t->fa_window; i++)
+  {
+    uint8_t *vaddr = t->fa_start + i * PGSIZE;
+    struct vm_entry *next;
+    struct page *kpage;
+    block_sector_t sector;
+
+    if (!is_user_vaddr (vaddr))
+      break;
+    next = find_vme (vaddr);
+    if (next == NULL || next->is_loaded || next->type != vme->type
+        || next->file != vme->file || next->read_bytes == 0
+        || next->offset != vme->offset + (i + 1) * PGSIZE)
+      break;
+
+    sector = inode_sector_at (inode, next->offset);
+    if (share_ok (next) && share_map (next))
+    {
+      prev = sector;
+      t->fa_cnt++;
+      continue;
+    }
+    if (sector == (block_sector_t) -1
+        || (!bc_cached (sector)
+            && (prev == (block_sector_t) -1
+                || sector != prev + PGSIZE / BLOCK_SECTOR_SIZE)))
+      break;
+    prev = sector;
+
+    kpage = try_alloc_page (PAL_USER);
+    if (kpage == NULL)
+      break;
+    if (!load_file (kpage->kaddr, next)
+        || !install_page (next->vaddr, kpage->kaddr, next->writable))
+    {
+      free_page (kpage->kaddr);
+      break;
+    }
+    kpage->vme = next;
+    next->is_loaded = true;
+    if (share_ok (next))
+      share_add (kpage);
+    lru_list_insert (kpage);
+    t->fa_cnt++;
+  }
+}
+
+/* pj3 : expand stack for page fault.  The new page is filled
+   like any other page of zeros, so a read maps the zero frame. */
+void
+stack_growth (void *addr, bool write)
+{
   struct vm_entry *vme = (struct vm_entry *)malloc(sizeof(struct vm_entry));
   if (! vme)
     return;
   
-  vme->type = VM_BIN;
+  vme->type = VM_ANON;
   vme->vaddr = pg_round_down (addr);
   vme->writable = true;
-  vme->is_loaded = true;
-
-
-  kpage = alloc_page (PAL_USER | PAL_ZERO);
-  
-  if (!kpage) //faile to allocate page
-    return;
-
-  
-  lru_list_insert (kpage);
-  install_page (pg_round_down (addr), kpage->kaddr, true);
-
-  kpage->vme = vme;
+  vme->is_loaded = false;
+  vme->cow = false;
+  vme->share = NULL;
+  vme->swap_slot = SWAP_SLOT_NONE;
 
   insert_vme (&thread_current ()->vm, vme);
+  handle_mm_fault (vme, write);
 }
 
 /* unmap mmap_file from process */
@@ -713,8 +1066,14 @@ do_munmap(struct mmap_file *mmap_file)
   while (e != list_end (&mmap_file->vme_list))
   {
     vme = list_entry (e, struct vm_entry, mmap_elem);
-    if (pagedir_is_dirty(t->pagedir, vme->vaddr) && vme->is_loaded)
-      file_write_at (vme->file, vme->vaddr, vme->read_bytes, vme->offset);
+    /* pinned so that the write back cannot fault on the page and
+       need the inode lock it holds */
+    if (vme->is_loaded && frame_pin (vme->vaddr))
+    {
+      if (pagedir_is_dirty (t->pagedir, vme->vaddr))
+        file_write_at (vme->file, vme->vaddr, vme->read_bytes, vme->offset);
+      frame_unpin (vme->vaddr);
+    }
     
     delete_vme (&t->vm, vme);
     e = list_remove (e);
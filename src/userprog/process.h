@@ -14,8 +14,11 @@ void process_activate (void);
 char * get_cmd_name (void *file_name_);
 
 /* pj3 */
-bool handle_mm_fault (struct vm_entry *vme);
-void stack_growth (void *addr);
+struct intr_frame;
+tid_t process_fork (struct intr_frame *f);
+bool handle_mm_fault (struct vm_entry *vme, bool write);
+bool handle_cow_fault (struct vm_entry *vme);
+void stack_growth (void *addr, bool write);
 void do_munmap(struct mmap_file *mmap_file);
 
 #endif /* userprog/process.h */
@@ -8,7 +8,12 @@
 #include "lib/user/syscall.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
+#include "userprog/exception.h"
+#include "userprog/pagedir.h"
+#include "vm/frame.h"
 #include "vm/page.h"
+#include "vm/swap.h"
+#include "userprog/process.h"
 
 static void syscall_handler (struct intr_frame *);
 
@@ -32,15 +37,20 @@ void munmap (int mapid);
 struct vm_entry * check_address (void* addr, void* esp /*Unused*/);
 void check_valid_buffer (void* buffer, unsigned size, void* esp, bool to_write);
 void check_valid_string (const void* str, void* esp);
+static bool pin_page (void *upage, bool write);
+static void pin_buffer (const void *buffer, unsigned size, bool write);
+static void unpin_buffer (const void *buffer, unsigned size);
 
+/* pj3 : most bytes of a user buffer read or written, and pinned,
+   at once.  A multiple of the page size keeps sector-aligned
+   transfers aligned from one piece to the next. */
+#define PIN_MAX (16 * PGSIZE)
 
-static struct lock filesys_lock; 
 
 void
 syscall_init (void) 
 {
   intr_register_int (0x30, 3, INTR_ON, syscall_handler, "syscall");
-  lock_init (&filesys_lock);
 }
 
 static void
@@ -62,7 +72,7 @@ syscall_handler (struct intr_frame *f)
   if (!pagedir_get_page (cur->pagedir, ptr))
     exit(-1);
 
-  if (*ptr < SYS_HALT || *ptr > SYS_INUMBER)
+  if (*ptr < SYS_HALT || *ptr > SYS_FORK)
     return;
 
   /* case each system call */
@@ -285,6 +295,13 @@ syscall_handler (struct intr_frame *f)
       f->eax = inumber (*(ptr +1));
       break;
     }
+
+    /* case fork */
+    case SYS_FORK:
+    {
+      f->eax = process_fork (f);
+      break;
+    }
   }
   return;
 }
@@ -313,13 +330,8 @@ pid_t
 exec (const char *cmd_line)
 { 
   tid_t tid;
-  /* lock acquire */
-  lock_acquire (&filesys_lock);
   tid = process_execute(cmd_line);
 
-  /* lock release */
-  lock_release (&filesys_lock);
-
   return tid;
 }
 
@@ -406,8 +418,7 @@ read (int fd, void *buffer, unsigned size)
   if(!buffer) exit(-1);
 
   /* pj2: case stanard input */
-  /* lock acquire */
-  lock_acquire (&filesys_lock);
+  /* file system locks per inode, so nothing to hold here */
   if (fd == 0){  
     int i;
     for (i = 0; i < size; i++)
@@ -420,10 +431,24 @@ read (int fd, void *buffer, unsigned size)
   /* pj2: case normal file descriptor */
   else if (fd > 2){ 
     if (!cur->file_fdt[fd]) exit(-1);
-    ret = file_read(cur->file_fdt[fd], buffer, size);
+    /* pj3 : the file system copies into the buffer with inode
+       locks held, so its pages are faulted in and pinned first */
+    ret = 0;
+    while (size > 0)
+    {
+      unsigned chunk = size < PIN_MAX ? size : PIN_MAX;
+      int n;
+
+      pin_buffer (buffer, chunk, true);
+      n = file_read (cur->file_fdt[fd], buffer, chunk);
+      unpin_buffer (buffer, chunk);
+      ret += n;
+      if ((unsigned) n < chunk)
+        break;
+      buffer = (uint8_t *) buffer + chunk;
+      size -= chunk;
+    }
   }
-  /* lock release */
-  lock_release (&filesys_lock);
   return ret;
 }
 
@@ -438,11 +463,8 @@ write (int fd, const void *buffer, unsigned size)
   /* pj2: check validty of pointer */
   if(!is_user_vaddr(buffer)) exit(-1);
   if(!buffer) exit(-1);
-  if(!pagedir_get_page(cur->pagedir, buffer)) exit(-1);
   
   /* pj2: case stanard input */
-  /* lock acquire */
-  lock_acquire(&filesys_lock);
   if (fd == 0) 
     ret = -1;
   /* pj2: case stanard output */
@@ -454,10 +476,23 @@ write (int fd, const void *buffer, unsigned size)
   /* pj2: case normal file descriptor */
   else if (fd > 2){
     if (! cur->file_fdt[fd]) exit(-1);
-    ret = file_write(cur->file_fdt[fd], buffer, size);
+    /* pj3 : pinned like the buffer of read */
+    ret = 0;
+    while (size > 0)
+    {
+      unsigned chunk = size < PIN_MAX ? size : PIN_MAX;
+      int n;
+
+      pin_buffer (buffer, chunk, false);
+      n = file_write (cur->file_fdt[fd], buffer, chunk);
+      unpin_buffer (buffer, chunk);
+      ret += n;
+      if ((unsigned) n < chunk)
+        break;
+      buffer = (const uint8_t *) buffer + chunk;
+      size -= chunk;
+    }
   }  
-  /* lock release */
-  lock_release (&filesys_lock);
   return ret;
 }
 
@@ -548,6 +583,10 @@ mmap (int fd, void *addr)
     vme->writable = true;
     vme->vaddr = addr;
     vme->offset = offset;
+    vme->is_loaded = false;
+    vme->cow = false;
+    vme->share = NULL;
+    vme->swap_slot = SWAP_SLOT_NONE;
 
     list_push_back (&mmap_file->vme_list, &vme->mmap_elem);
     insert_vme (&t->vm, vme);
@@ -655,3 +694,76 @@ check_valid_string (const void* str, void* esp)
   check_address (str, esp);
 }
 
+/* pj3 : fault in user page UPAGE of the current process, with a
+   frame of its own if the kernel will WRITE it, and pin the frame.
+   A fault on the page while the file system holds an inode lock
+   could need that lock itself, to load or write back a mapping of
+   the same file.  Returns false if UPAGE is not a valid page. */
+static bool
+pin_page (void *upage, bool write)
+{
+  struct thread *cur = thread_current ();
+  struct vm_entry *vme;
+  bool success;
+
+  for (;;)
+  {
+    vme = find_vme (upage);
+    if (vme == NULL)
+    {
+      if (!check_stack_status ((int32_t) upage, (int32_t) cur->esp))
+        return false;
+      stack_growth (upage, write);
+      if (find_vme (upage) == NULL)
+        return false;
+      continue;
+    }
+    if (write && !vme->writable)
+      return false;
+
+    if (pagedir_get_page (cur->pagedir, upage) == NULL)
+      success = handle_mm_fault (vme, write);
+    else if (write && vme->cow)
+      success = handle_cow_fault (vme);
+    else if (frame_pin (upage))
+      return true;
+    else
+      success = true;
+    if (!success)
+      return false;
+  }
+}
+
+/* pj3 : pin the pages of user BUFFER of SIZE bytes with pin_page,
+   exiting the process if one is not valid */
+static void
+pin_buffer (const void *buffer, unsigned size, bool write)
+{
+  uint8_t *start = pg_round_down (buffer);
+  uint8_t *end = (uint8_t *) buffer + size;
+  uint8_t *upage;
+
+  if (size == 0)
+    return;
+  check_address ((void *) buffer, NULL);
+  check_address (end - 1, NULL);
+  for (upage = start; upage < end; upage += PGSIZE)
+    if (!pin_page (upage, write))
+    {
+      unpin_buffer (start, upage - start);
+      exit (-1);
+    }
+}
+
+/* pj3 : undo pin_buffer */
+static void
+unpin_buffer (const void *buffer, unsigned size)
+{
+  uint8_t *upage;
+
+  if (size == 0)
+    return;
+  for (upage = pg_round_down (buffer);
+       upage < (uint8_t *) buffer + size; upage += PGSIZE)
+    frame_unpin (upage);
+}
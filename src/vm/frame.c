@@ -1,4 +1,7 @@
 #include "vm/frame.h"
+#include <string.h>
+#include "threads/malloc.h"
+#include "threads/palloc.h"
 #include "threads/thread.h"
 #include "threads/synch.h"
 #include "threads/interrupt.h"
@@ -6,50 +9,352 @@
 #include "userprog/pagedir.h"
 
 
+/* one page per user pool frame, indexed by palloc_user_page_idx.
+   A page is in use while its kaddr is set. */
+static struct page *frame_table;
+
+/* a page of zeros shared read-only by every all-zero page that has
+   not been written yet.  It is from the kernel pool, so it is never
+   in frame_table or lru_list. */
+static void *zero_frame;
+
 /* lru_list manage physical pages in use as a list of pages */
 static struct list lru_list;
 
-/* initializer lru list*/
+/* protects lru_list and clock_hand */
+static struct lock lru_list_lock;
+
+/* signalled on lru_list_lock whenever an eviction finishes */
+static struct condition evict_cond;
+
+/* next page the clock looks at, NULL for the front of lru_list.
+   lru_list is treated as a circle, with new pages inserted just
+   behind the hand so that they are looked at last. */
+static struct list_elem *clock_hand;
+
+/* -evict: how evict_frame chooses its victim */
+static enum evict_policy evict_policy = EVICT_CLOCK;
+
+static void lru_unlink (struct page *);
+static struct page *clock_next (void);
+static struct page *evict_fifo (void);
+static struct page *evict_clock (void);
+static struct page *evict_esc (void);
+
+/* initializer frame table and lru list*/
 void
 lru_list_init (void)
 {
+  frame_table = calloc (palloc_user_page_cnt (), sizeof *frame_table);
+  if (frame_table == NULL)
+    PANIC ("frame table allocation failed");
   list_init (&lru_list);
+  lock_init (&lru_list_lock);
+  cond_init (&evict_cond);
+  clock_hand = NULL;
+  zero_frame = palloc_get_page (PAL_ASSERT | PAL_ZERO);
+}
+
+/* choose eviction policy by NAME, "fifo", "clock" or "esc".
+   Returns false if NAME is none of them. */
+bool
+evict_policy_set (const char *name)
+{
+  if (name == NULL)
+    return false;
+  if (!strcmp (name, "fifo"))
+    evict_policy = EVICT_FIFO;
+  else if (!strcmp (name, "clock"))
+    evict_policy = EVICT_CLOCK;
+  else if (!strcmp (name, "esc"))
+    evict_policy = EVICT_ESC;
+  else
+    return false;
+  return true;
+}
+
+/* return the frame table slot for user pool page KADDR */
+struct page *
+frame_table_get (void *kaddr)
+{
+  return &frame_table[palloc_user_page_idx (kaddr)];
+}
+
+/* return the shared zero frame */
+void *
+frame_zero (void)
+{
+  return zero_frame;
 }
 
 /* insert corresponding page to lru_list */
 void
 lru_list_insert (struct page *page)
 {
-  list_push_back (&lru_list, &page->lru);
+  lock_acquire (&lru_list_lock);
+  if (clock_hand != NULL)
+    list_insert (clock_hand, &page->lru);
+  else
+    list_push_back (&lru_list, &page->lru);
+  lock_release (&lru_list_lock);
 }
 
-/* delete corresponding page from lru_list */
-void
+/* delete corresponding page from lru_list.  Returns false if it
+   was not on the list, being evicted or not inserted yet. */
+bool
 lru_list_delete (struct page *page)
 {
+  bool linked;
+
+  lock_acquire (&lru_list_lock);
+  linked = page->lru.prev != NULL;
+  if (linked)
+    lru_unlink (page);
+  lock_release (&lru_list_lock);
+  return linked;
+}
+
+/* take PAGE off lru_list, moving clock_hand past it.
+   lru_list_lock must be held. */
+static void
+lru_unlink (struct page *page)
+{
+  if (clock_hand == &page->lru)
+    clock_hand = list_next (clock_hand);
   list_remove (&page->lru);
+  page->lru.prev = page->lru.next = NULL;
 }
 
-/* find corresponding page from lru_list */
+/* find corresponding page from frame table, NULL if not in use */
 struct page *
 lru_list_find (void *kaddr)
+{
+  struct page *page = frame_table_get (kaddr);
+
+  return page->kaddr == kaddr ? page : NULL;
+}
+
+/* select victim of swapping by the -evict policy and take it off
+   lru_list, NULL if there is no page to evict.  Pinned pages are
+   passed over.  Choosing and
+   unlinking under one hold of lru_list_lock keeps two evicting
+   threads from getting the same page. */
+struct page *
+evict_frame (void)
+{
+  struct page *victim;
+
+  lock_acquire (&lru_list_lock);
+  if (list_empty (&lru_list))
+    victim = NULL;
+  else switch (evict_policy)
+  {
+    case EVICT_FIFO:
+      victim = evict_fifo ();
+      break;
+
+    case EVICT_ESC:
+      victim = evict_esc ();
+      break;
+
+    case EVICT_CLOCK:
+    default:
+      victim = evict_clock ();
+      break;
+  }
+  if (victim != NULL)
+  {
+    lru_unlink (victim);
+    victim->evicting = true;
+  }
+  lock_release (&lru_list_lock);
+  return victim;
+}
+
+/* finish evicting PAGE, chosen by evict_frame and unmapped: mark
+   its vm entry not loaded, wake threads faulting on it and free
+   the frame */
+void
+evict_done (struct page *page)
+{
+  void *kaddr = page->kaddr;
+
+  lock_acquire (&lru_list_lock);
+  if (page->vme != NULL)
+    page->vme->is_loaded = false;
+  memset (page, 0, sizeof *page);
+  cond_broadcast (&evict_cond, &lru_list_lock);
+  lock_release (&lru_list_lock);
+  palloc_free_page (kaddr);
+}
+
+/* take the private frames of T, which is exiting, off lru_list
+   so that they are not evicted while T frees them, waiting for
+   evictions of them already under way.  Shared frames are left to
+   share_unmap. */
+void
+lru_list_exit (struct thread *t)
+{
+  size_t cnt = palloc_user_page_cnt ();
+  size_t i;
+
+  lock_acquire (&lru_list_lock);
+  for (i = 0; i < cnt; i++)
+  {
+    struct page *page = &frame_table[i];
+
+    while (page->kaddr != NULL && page->thread == t && page->evicting)
+      cond_wait (&evict_cond, &lru_list_lock);
+    if (page->kaddr != NULL && page->thread == t && !page->shared
+        && page->lru.prev != NULL)
+      lru_unlink (page);
+  }
+  lock_release (&lru_list_lock);
+}
+
+/* wait until VME, loaded but unmapped for eviction, is written
+   back and no longer loaded */
+void
+evict_wait (struct vm_entry *vme)
+{
+  lock_acquire (&lru_list_lock);
+  while (vme->is_loaded)
+    cond_wait (&evict_cond, &lru_list_lock);
+  lock_release (&lru_list_lock);
+}
+
+/* pin the frame that user page UPAGE of the current process is
+   mapped to, so that it is not evicted until frame_unpin.  Returns
+   false if UPAGE is not mapped, or if its frame is being evicted,
+   after waiting for that to finish. */
+bool
+frame_pin (const void *upage)
+{
+  struct page *page;
+  void *kaddr;
+  bool success = false;
+
+  lock_acquire (&lru_list_lock);
+  kaddr = pagedir_get_page (thread_current ()->pagedir, upage);
+  if (kaddr == zero_frame)
+    success = true;
+  else if (kaddr != NULL && (page = lru_list_find (kaddr)) != NULL)
+  {
+    if (page->evicting)
+      cond_wait (&evict_cond, &lru_list_lock);
+    else
+    {
+      page->pin_cnt++;
+      success = true;
+    }
+  }
+  lock_release (&lru_list_lock);
+  return success;
+}
+
+/* undo frame_pin of user page UPAGE of the current process */
+void
+frame_unpin (const void *upage)
+{
+  struct page *page;
+  void *kaddr;
+
+  lock_acquire (&lru_list_lock);
+  kaddr = pagedir_get_page (thread_current ()->pagedir, upage);
+  if (kaddr != NULL && kaddr != zero_frame
+      && (page = lru_list_find (kaddr)) != NULL && page->pin_cnt > 0)
+    page->pin_cnt--;
+  lock_release (&lru_list_lock);
+}
+
+/* return page under clock_hand and advance the hand, wrapping
+   around at the end of lru_list */
+static struct page *
+clock_next (void)
+{
+  struct page *page;
+
+  if (clock_hand == NULL || clock_hand == list_end (&lru_list))
+    clock_hand = list_begin (&lru_list);
+  page = list_entry (clock_hand, struct page, lru);
+  clock_hand = list_next (clock_hand);
+  return page;
+}
+
+/* oldest page that is not pinned, whether or not it is in use */
+static struct page *
+evict_fifo (void)
 {
   struct list_elem *e;
-  for (e = list_begin (&lru_list); e != list_end (&lru_list); e = list_next (e))
+
+  for (e = list_begin (&lru_list); e != list_end (&lru_list);
+       e = list_next (e))
   {
     struct page *page = list_entry (e, struct page, lru);
-    if (page->kaddr == kaddr)
+
+    if (page->pin_cnt == 0)
       return page;
   }
   return NULL;
 }
 
-/* select victim of swapping */
-struct page *
-evict_frame (void)
+/* second chance: pass over and clear accessed pages until one
+   that was not accessed since the hand last went by.  Two turns
+   of the hand find one unless every page is pinned or in use
+   again by then. */
+static struct page *
+evict_clock (void)
 {
-  return list_entry (list_begin (&lru_list), struct page, lru);
+  size_t cnt = list_size (&lru_list) * 2;
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+  {
+    struct page *page = clock_next ();
+    uint32_t *pd = page->thread->pagedir;
+
+    if (page->pin_cnt > 0)
+      continue;
+    if (!pagedir_is_accessed (pd, page->vme->vaddr))
+      return page;
+    pagedir_set_accessed (pd, page->vme->vaddr, false);
+  }
+  return NULL;
 }
 
+/* enhanced second chance: prefer pages neither accessed nor dirty,
+   which need no write back, then ones not accessed but dirty,
+   clearing accessed bits while looking for the latter.  Gives up
+   after two rounds, like evict_clock. */
+static struct page *
+evict_esc (void)
+{
+  size_t cnt = list_size (&lru_list);
+  size_t round, i;
+
+  for (round = 0; round < 2; round++)
+  {
+    for (i = 0; i < cnt; i++)
+    {
+      struct page *page = clock_next ();
+      uint32_t *pd = page->thread->pagedir;
+
+      if (page->pin_cnt == 0
+          && !pagedir_is_accessed (pd, page->vme->vaddr)
+          && !pagedir_is_dirty (pd, page->vme->vaddr))
+        return page;
+    }
+    for (i = 0; i < cnt; i++)
+    {
+      struct page *page = clock_next ();
+      uint32_t *pd = page->thread->pagedir;
 
-  
\ No newline at end of file
+      if (page->pin_cnt > 0)
+        continue;
+      if (!pagedir_is_accessed (pd, page->vme->vaddr))
+        return page;
+      pagedir_set_accessed (pd, page->vme->vaddr, false);
+    }
+  }
+  return NULL;
+}
@@ -4,10 +4,26 @@
 
 #include "vm/page.h"
 
+/* how evict_frame chooses its victim, set with -evict */
+enum evict_policy
+{
+  EVICT_FIFO,           /* oldest page */
+  EVICT_CLOCK,          /* second chance on accessed bit */
+  EVICT_ESC             /* enhanced second chance, accessed and dirty */
+};
+
 void lru_list_init (void);
+bool evict_policy_set (const char *);
 void lru_list_insert (struct page *);
-void lru_list_delete (struct page *);
+bool lru_list_delete (struct page *);
+struct page *frame_table_get (void *);
+void *frame_zero (void);
 struct page *lru_list_find (void *);
 struct page *evict_frame ();
+void evict_done (struct page *);
+void evict_wait (struct vm_entry *);
+void lru_list_exit (struct thread *);
+bool frame_pin (const void *);
+void frame_unpin (const void *);
 
 #endif
\ No newline at end of file
@@ -1,10 +1,14 @@
 #include "page.h"
+#include "vm/frame.h"
+#include "vm/swap.h"
+#include "vm/share.h"
 #include "threads/vaddr.h"
 #include "threads/thread.h"
 #include "threads/malloc.h"
 #include "userprog/pagedir.h"
 #include "filesys/file.h"
 #include "threads/interrupt.h"
+#include "threads/synch.h"
 #include <string.h>
 #include <stdio.h>
 
@@ -47,30 +51,34 @@ insert_vme (struct hash *vm, struct vm_entry *vme)
 bool
 delete_vme (struct hash *vm, struct vm_entry *vme)
 {
+  struct thread *t = thread_current ();
+
+  if (t->vme_hint == vme)
+    t->vme_hint = NULL;
   return hash_delete (vm, &vme->elem) != NULL; 
 }
 
 
 /* find_vme success >> vme, fail >> NULL */
+/* the last vme found is remembered in vme_hint, since faults and
+   address checks tend to hit the same page several times in a row */
 struct vm_entry *
 find_vme (void *vaddr)
 {
-  struct hash *vm = &thread_current ()->vm;
-  struct hash_iterator i;
-  struct vm_entry *vme;
-  int id = 0;
+  struct thread *t = thread_current ();
+  struct vm_entry key;
+  struct hash_elem *e;
 
-  hash_first (&i, vm);
-  while (hash_next (&i))
-  {
-    vme = hash_entry (hash_cur (&i), struct vm_entry, elem);
+  key.vaddr = pg_round_down (vaddr);
+  if (t->vme_hint != NULL && t->vme_hint->vaddr == key.vaddr)
+    return t->vme_hint;
 
-    if (vme->vaddr == pg_round_down(vaddr))
-    {
-      return vme;
-    }
-  }
-  return NULL;
+  e = hash_find (&t->vm, &key.elem);
+  if (e == NULL)
+    return NULL;
+
+  t->vme_hint = hash_entry (e, struct vm_entry, elem);
+  return t->vme_hint;
 }
 
 /* For debugging */
@@ -107,14 +115,31 @@ show_vme (struct vm_entry *vme)
 void 
 vm_destroy (struct hash *vm)
 {
+  thread_current ()->vme_hint = NULL;
+  lru_list_exit (thread_current ());
   hash_destroy (vm, vm_destroy_func);
 }
 
-/* free vm entry for corresponding hash element */
+/* free vm entry for corresponding hash element, its frame and
+   its swap slot */
 static void
 vm_destroy_func (struct hash_elem *e, void *aux UNUSED)
 {
   struct vm_entry *vme = hash_entry (e, struct vm_entry, elem);
+  uint32_t *pd = thread_current ()->pagedir;
+
+  if (vme->share != NULL && share_unmap (vme))
+    ;
+  else if (vme->is_loaded && pd != NULL)
+  {
+    void *kaddr = pagedir_get_page (pd, vme->vaddr);
+    if (kaddr == frame_zero ())
+      pagedir_clear_page (pd, vme->vaddr);
+    else if (kaddr != NULL)
+      free_page (kaddr);
+  }
+  if (vme->swap_slot != SWAP_SLOT_NONE)
+    swap_free (vme->swap_slot);
   free (vme);
 }
 
@@ -134,61 +159,192 @@ load_file (void *kaddr, struct vm_entry *vme)
   return true;
 }
 
-/* handle swapping for each type of vm entry */
-static void handle_swap (void)
+/* page-out daemon: woken by alloc_page when fewer than
+   pageout_low user frames are free, it evicts until pageout_high
+   are, so that most faults find a free frame without waiting for
+   a write back */
+static size_t pageout_low, pageout_high;
+static struct lock pageout_lock;
+static struct condition pageout_cond;
+
+static void pageout_daemon (void *aux UNUSED);
+static bool handle_swap (void);
+
+/* start the page-out daemon, keeping 1/32 to 1/16 of the user
+   pool free */
+void
+pageout_init (void)
 {
-  struct page *victim = evict_frame ();
-  bool dirty; 
-  dirty = pagedir_is_dirty (victim->thread->pagedir, victim->vme->vaddr);
+  pageout_low = palloc_user_page_cnt () / 32;
+  if (pageout_low < 1)
+    pageout_low = 1;
+  pageout_high = pageout_low * 2;
+  lock_init (&pageout_lock);
+  cond_init (&pageout_cond);
+  if (thread_create ("pageout", PRI_DEFAULT, pageout_daemon, NULL)
+      == TID_ERROR)
+    PANIC ("page-out daemon creation failed");
+}
 
-  /* vm entry type */
-  switch (victim->vme->type)
+/* evict in batches whenever free frames run low.  When there is
+   nothing to evict, wait for the next allocation to try again
+   rather than spin. */
+static void
+pageout_daemon (void *aux UNUSED)
+{
+  bool stalled = false;
+
+  for (;;)
   {
-    case VM_BIN:
-      if (dirty)
+    lock_acquire (&pageout_lock);
+    while (stalled || palloc_user_free_cnt () >= pageout_low)
+    {
+      cond_wait (&pageout_cond, &pageout_lock);
+      stalled = false;
+    }
+    lock_release (&pageout_lock);
+
+    while (palloc_user_free_cnt () < pageout_high)
+      if (!handle_swap ())
       {
-        victim->vme->swap_slot = swap_out (victim->kaddr);
-        victim->vme->type = VM_ANON;
+        stalled = true;
+        break;
       }
-      break;
+  }
+}
 
-    case VM_FILE:
-      if (dirty)
-        file_write_at (victim->vme->file, victim->vme->vaddr,
-                            victim->vme->read_bytes, victim->vme->offset);
-      break;
+/* handle swapping for each type of vm entry */
+/* up to SWAP_BATCH victims are evicted at once, and those going to
+   swap are written together into one run of slots.  A clean anon
+   page still holding the slot it came from is dropped unwritten.
+   Each victim is unmapped before its dirty bit is read, so that
+   its process faults and waits in evict_wait rather than store
+   into the frame while it is written back.
+   Returns false if there was no page to evict. */
+static bool handle_swap (void)
+{
+  struct page *victims[SWAP_BATCH];
+  struct page *swapped[SWAP_BATCH];
+  size_t cnt, swap_cnt = 0, i;
 
-    case VM_ANON:
-      victim->vme->swap_slot = swap_out (victim->kaddr);
+  /* evict_frame takes each victim off lru_list, so the next pick
+     is another page */
+  for (cnt = 0; cnt < SWAP_BATCH; cnt++)
+  {
+    victims[cnt] = evict_frame ();
+    if (victims[cnt] == NULL)
       break;
+  }
+  if (cnt == 0)
+  {
+    /* every frame is being loaded or evicted, let others finish */
+    thread_yield ();
+    return false;
+  }
 
-    default:
-      break;
+  for (i = 0; i < cnt; i++)
+  {
+    struct page *victim = victims[i];
+    bool dirty; 
+
+    /* unmap a shared frame everywhere */
+    if (victim->shared && share_evict (victim))
+    {
+      victim->vme = NULL;
+      continue;
+    }
+    /* its last sharer let go of it meanwhile */
+    if (victim->vme == NULL)
+      continue;
+    pagedir_clear_page (victim->thread->pagedir, victim->vme->vaddr);
+    dirty = pagedir_is_dirty (victim->thread->pagedir, victim->vme->vaddr);
+
+    /* vm entry type */
+    switch (victim->vme->type)
+    {
+      case VM_BIN:
+        if (dirty)
+        {
+          swapped[swap_cnt++] = victim;
+          victim->vme->type = VM_ANON;
+        }
+        break;
+
+      case VM_FILE:
+        if (dirty)
+          file_write_at (victim->vme->file, victim->kaddr,
+                              victim->vme->read_bytes, victim->vme->offset);
+        break;
+
+      case VM_ANON:
+        if (!dirty && victim->vme->swap_slot != SWAP_SLOT_NONE)
+          break;
+        if (victim->vme->swap_slot != SWAP_SLOT_NONE)
+          swap_free (victim->vme->swap_slot);
+        swapped[swap_cnt++] = victim;
+        break;
+
+      default:
+        break;
+    }
   }
-  victim->vme->is_loaded = false;
-  free_page (victim->kaddr);
+
+  if (swap_cnt > 0)
+    swap_out_batch (swapped, swap_cnt);
+
+  for (i = 0; i < cnt; i++)
+    evict_done (victims[i]);
+  return true;
 }
 
 /* allocate physical memory for each segment */
-struct page *
-alloc_page (enum palloc_flags flags)
+/* set up the frame table slot of frame KADDR for current thread */
+static struct page *
+init_page (void *kaddr)
 {
-  struct page *page;
-  page = (struct page *) malloc (sizeof (struct page));
-  if (! page)
-    return NULL;
+  struct page *page = frame_table_get (kaddr);
 
   memset (page, 0, sizeof (struct page));
   page->thread = thread_current ();
-  page->kaddr = palloc_get_page (flags);
+  page->kaddr = kaddr;
+  return page;
+}
+
+/* page comes from the frame table slot of the frame */
+struct page *
+alloc_page (enum palloc_flags flags)
+{
+  void *kaddr;
+
+  ASSERT (flags & PAL_USER);
+  kaddr = palloc_get_page (flags);
 
   /* no physical memory available than swap */
-  while (page->kaddr == NULL)
+  while (kaddr == NULL)
   {
     handle_swap ();
-    page->kaddr = palloc_get_page (flags);
+    kaddr = palloc_get_page (flags);
   }
-  return page;
+
+  if (palloc_user_free_cnt () < pageout_low)
+  {
+    lock_acquire (&pageout_lock);
+    cond_signal (&pageout_cond, &pageout_lock);
+    lock_release (&pageout_lock);
+  }
+  return init_page (kaddr);
+}
+
+/* like alloc_page, but return NULL rather than swap when no
+   physical memory is free */
+struct page *
+try_alloc_page (enum palloc_flags flags)
+{
+  void *kaddr;
+
+  ASSERT (flags & PAL_USER);
+  kaddr = palloc_get_page (flags);
+  return kaddr != NULL ? init_page (kaddr) : NULL;
 }
 
 /* free physical page for coresponding physical address */
@@ -197,9 +353,10 @@ free_page(void *addr)
 {
   struct page *page = lru_list_find (addr);
   if (page){
-    pagedir_clear_page (page->thread->pagedir, page->vme->vaddr);
+    if (page->vme != NULL)
+      pagedir_clear_page (page->thread->pagedir, page->vme->vaddr);
     lru_list_delete (page);
-    palloc_free_page (page->kaddr);
-    free (page);
+    memset (page, 0, sizeof (struct page));
+    palloc_free_page (addr);
   }
 }
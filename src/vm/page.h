@@ -19,6 +19,10 @@ struct vm_entry
     bool writable;
 
     bool is_loaded;
+    bool cow;               /* mapped read-only to a shared frame */
+    struct page *share;     /* shared text frame mapped, see vm/share.c */
+    struct thread *thread;  /* process mapping share */
+    struct list_elem share_elem;
     struct file *file;
 
     struct list_elem mmap_elem;
@@ -37,6 +41,16 @@ struct page
     struct vm_entry *vme;
     struct thread *thread;
     struct list_elem lru;
+    bool evicting;          /* taken by evict_frame, until evict_done */
+    unsigned pin_cnt;       /* frame_pin holds, never evicted while > 0 */
+
+    /* shared frames only, see vm/share.c.  inode is NULL for
+       frames shared copy-on-write rather than as text. */
+    bool shared;
+    struct inode *inode;
+    size_t offset;
+    struct list sharers;
+    struct hash_elem share_elem;
 };
 
 struct mmap_file
@@ -58,7 +72,9 @@ bool load_file (void *kaddr, struct vm_entry *vme);
 void show_vm ();
 void show_vme (struct vm_entry *vme);
 
+void pageout_init (void);
 struct page *alloc_page (enum palloc_flags);
+struct page *try_alloc_page (enum palloc_flags);
 void free_page (void *);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,400 @@
+#include "vm/share.h"
+#include "vm/page.h"
+#include "vm/frame.h"
+#include "vm/swap.h"
+#include "threads/thread.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+#include "userprog/pagedir.h"
+#include "filesys/file.h"
+#include <hash.h>
+#include <list.h>
+#include <string.h>
+
+/* read-only executable pages in memory, keyed by the inode and
+   offset they were loaded from, so that every process running the
+   same executable maps the same frame.  Each is a frame table page
+   whose sharers list holds the vm entries mapping it.  Frames
+   shared copy-on-write after fork have sharers too, but are not in
+   share_table. */
+static struct hash share_table;
+
+/* protects share_table and the sharers of every shared page */
+static struct lock share_lock;
+
+static unsigned share_hash_func (const struct hash_elem *, void * UNUSED);
+static bool share_less_func (const struct hash_elem *,
+                             const struct hash_elem *, void * UNUSED);
+static void share_detach (struct vm_entry *);
+
+/* initialize share table */
+void
+share_init (void)
+{
+  hash_init (&share_table, share_hash_func, share_less_func, NULL);
+  lock_init (&share_lock);
+}
+
+/* hash page by its inode and offset */
+static unsigned
+share_hash_func (const struct hash_elem *e, void *aux UNUSED)
+{
+  struct page *page = hash_entry (e, struct page, share_elem);
+  return hash_bytes (&page->inode, sizeof page->inode)
+         ^ hash_int (page->offset);
+}
+
+/* order pages by inode, then offset */
+static bool
+share_less_func (const struct hash_elem *a,
+                 const struct hash_elem *b, void *aux UNUSED)
+{
+  struct page *pa = hash_entry (a, struct page, share_elem);
+  struct page *pb = hash_entry (b, struct page, share_elem);
+
+  if (pa->inode != pb->inode)
+    return pa->inode < pb->inode;
+  return pa->offset < pb->offset;
+}
+
+/* true if VME is a read-only executable page that can be shared */
+bool
+share_ok (struct vm_entry *vme)
+{
+  return vme->type == VM_BIN && !vme->writable && vme->read_bytes > 0;
+}
+
+/* map VME to the frame already holding its page, if any.
+   Returns false if there is none and VME must be loaded, or if
+   VME is already loaded or mapped. */
+bool
+share_map (struct vm_entry *vme)
+{
+  struct thread *t = thread_current ();
+  struct page key, *page;
+  struct hash_elem *e;
+  bool success = false;
+
+  if (vme->is_loaded || pagedir_get_page (t->pagedir, vme->vaddr) != NULL)
+    return false;
+
+  key.inode = file_get_inode (vme->file);
+  key.offset = vme->offset;
+
+  lock_acquire (&share_lock);
+  e = hash_find (&share_table, &key.share_elem);
+  if (e != NULL)
+  {
+    page = hash_entry (e, struct page, share_elem);
+    if (page->vme->read_bytes == vme->read_bytes
+        && pagedir_set_page (t->pagedir, vme->vaddr, page->kaddr, false))
+    {
+      list_push_back (&page->sharers, &vme->share_elem);
+      vme->thread = t;
+      vme->share = page;
+      vme->is_loaded = true;
+      success = true;
+    }
+  }
+  lock_release (&share_lock);
+  return success;
+}
+
+/* make PAGE, just loaded for PAGE->vme, the shared frame for its
+   inode and offset.  Must be called before PAGE is in lru_list.
+   If another process loaded the same page first, PAGE stays
+   private. */
+void
+share_add (struct page *page)
+{
+  struct vm_entry *vme = page->vme;
+
+  lock_acquire (&share_lock);
+  page->inode = file_get_inode (vme->file);
+  page->offset = vme->offset;
+  if (hash_insert (&share_table, &page->share_elem) == NULL)
+  {
+    list_init (&page->sharers);
+    list_push_back (&page->sharers, &vme->share_elem);
+    vme->thread = page->thread;
+    vme->share = page;
+    page->shared = true;
+  }
+  else
+    page->inode = NULL;
+  lock_release (&share_lock);
+}
+
+/* take VME off the sharers of its frame.  A frame left with none
+   is freed, unless it is being evicted, when the evicting thread
+   frees it.  A copy-on-write frame left with one sharer stays
+   shared until that process writes it, see share_claim, so that
+   frames change owner only in the owner's own thread. */
+static void
+share_detach (struct vm_entry *vme)
+{
+  struct page *page = vme->share;
+
+  list_remove (&vme->share_elem);
+  vme->share = NULL;
+
+  if (list_empty (&page->sharers))
+  {
+    if (page->inode != NULL)
+      hash_delete (&share_table, &page->share_elem);
+    page->vme = NULL;
+    page->inode = NULL;
+    page->shared = false;
+    if (lru_list_delete (page))
+      free_page (page->kaddr);
+    return;
+  }
+
+  /* the accessed bit of the first sharer stands for the page */
+  page->vme = list_entry (list_front (&page->sharers),
+                          struct vm_entry, share_elem);
+  page->thread = page->vme->thread;
+}
+
+/* unmap VME from its shared frame.  Returns false if VME was no
+   longer sharing one, so that the caller frees its frame. */
+bool
+share_unmap (struct vm_entry *vme)
+{
+  bool shared;
+
+  lock_acquire (&share_lock);
+  shared = vme->share != NULL;
+  if (shared)
+  {
+    pagedir_clear_page (vme->thread->pagedir, vme->vaddr);
+    vme->is_loaded = false;
+    share_detach (vme);
+  }
+  lock_release (&share_lock);
+  return shared;
+}
+
+/* map CVME, the vm entry of the current process copied from PVME
+   of PARENT, to the frame PVME has.  A private frame becomes
+   shared by both, mapped read-only, and writable pages get their
+   own copy on the first write.  CVME is left not loaded if PVME is
+   not loaded.  Returns false if CVME could not be mapped. */
+bool
+share_fork (struct thread *parent, struct vm_entry *pvme,
+            struct vm_entry *cvme)
+{
+  struct thread *t = thread_current ();
+  struct page *page = NULL;
+  void *kaddr;
+  bool success = false;
+
+  lock_acquire (&share_lock);
+  for (;;)
+  {
+    if (!pvme->is_loaded)
+    {
+      lock_release (&share_lock);
+      return true;
+    }
+    kaddr = pagedir_get_page (parent->pagedir, pvme->vaddr);
+    if (kaddr == NULL || kaddr == frame_zero () || pvme->share != NULL)
+      break;
+
+    /* keep the frame off lru_list while it changes hands, waiting
+       for an eviction already under way to finish */
+    page = lru_list_find (kaddr);
+    if (page != NULL && lru_list_delete (page))
+      break;
+    lock_release (&share_lock);
+    thread_yield ();
+    lock_acquire (&share_lock);
+  }
+
+  if (kaddr == NULL)
+    ;
+  else if (kaddr == frame_zero ())
+  {
+    success = pagedir_set_page (t->pagedir, cvme->vaddr, kaddr, false);
+    cvme->cow = true;
+  }
+  else if (pvme->share != NULL)
+  {
+    page = pvme->share;
+    success = pagedir_set_page (t->pagedir, cvme->vaddr, kaddr, false);
+    if (success)
+    {
+      list_push_back (&page->sharers, &cvme->share_elem);
+      cvme->thread = t;
+      cvme->share = page;
+      cvme->cow = pvme->cow;
+    }
+  }
+  else
+  {
+    /* the read-only mappings start clean, so a page changed since
+       it was loaded must not be dropped as a clean one */
+    if (pagedir_is_dirty (parent->pagedir, pvme->vaddr))
+    {
+      if (pvme->type == VM_BIN)
+        pvme->type = VM_ANON;
+      else if (pvme->swap_slot != SWAP_SLOT_NONE)
+      {
+        swap_free (pvme->swap_slot);
+        pvme->swap_slot = SWAP_SLOT_NONE;
+      }
+    }
+    cvme->type = pvme->type;
+
+    success = pagedir_set_page (t->pagedir, cvme->vaddr, kaddr, false);
+    if (success)
+    {
+      if (pvme->writable)
+      {
+        pagedir_clear_page (parent->pagedir, pvme->vaddr);
+        pagedir_set_page (parent->pagedir, pvme->vaddr, kaddr, false);
+        pvme->cow = true;
+      }
+      list_init (&page->sharers);
+      list_push_back (&page->sharers, &pvme->share_elem);
+      list_push_back (&page->sharers, &cvme->share_elem);
+      pvme->thread = parent;
+      pvme->share = page;
+      cvme->thread = t;
+      cvme->share = page;
+      cvme->cow = pvme->cow;
+      page->shared = true;
+    }
+    lru_list_insert (page);
+  }
+  cvme->is_loaded = success;
+  lock_release (&share_lock);
+  return success;
+}
+
+/* write fault on VME, mapped read-only to a frame it may write.
+   If no other process maps the frame any more, map it writable
+   and return true.  Returns false if VME needs a copy. */
+bool
+share_claim (struct vm_entry *vme)
+{
+  uint32_t *pd = thread_current ()->pagedir;
+  struct page *page;
+  void *kaddr;
+  bool done = true;
+
+  lock_acquire (&share_lock);
+  if (vme->cow && vme->is_loaded)
+  {
+    kaddr = pagedir_get_page (pd, vme->vaddr);
+
+    /* the last sharer of a copy-on-write frame takes it over */
+    page = vme->share;
+    if (page != NULL && page->inode == NULL
+        && list_size (&page->sharers) == 1)
+    {
+      list_remove (&vme->share_elem);
+      vme->share = NULL;
+      page->thread = vme->thread;
+      page->shared = false;
+    }
+
+    if (vme->share != NULL || kaddr == NULL || kaddr == frame_zero ())
+      done = false;
+    else
+    {
+      pagedir_clear_page (pd, vme->vaddr);
+      pagedir_set_page (pd, vme->vaddr, kaddr, true);
+      vme->cow = false;
+    }
+  }
+  lock_release (&share_lock);
+  return done;
+}
+
+/* write fault on VME, mapped read-only to a shared frame: copy the
+   frame to KADDR and map that writable instead.  Returns false,
+   leaving KADDR unused, if VME changed meanwhile and the fault
+   should just be retried. */
+bool
+share_copy (struct vm_entry *vme, void *kaddr)
+{
+  uint32_t *pd = thread_current ()->pagedir;
+  void *shared;
+  bool success = false;
+
+  lock_acquire (&share_lock);
+  shared = pagedir_get_page (pd, vme->vaddr);
+  if (vme->cow && vme->is_loaded && shared != NULL)
+  {
+    memcpy (kaddr, shared, PGSIZE);
+    pagedir_clear_page (pd, vme->vaddr);
+    success = pagedir_set_page (pd, vme->vaddr, kaddr, true);
+    if (vme->share != NULL)
+      share_detach (vme);
+    vme->cow = false;
+    vme->is_loaded = success;
+  }
+  lock_release (&share_lock);
+  return success;
+}
+
+/* unmap shared PAGE, chosen for eviction, from every process.
+   Text is clean and is just unmapped.  A copy-on-write frame is
+   written to swap for each process that has no copy there yet.
+   Returns false if PAGE is no longer shared, to be evicted like a
+   private frame.  The caller frees it. */
+bool
+share_evict (struct page *page)
+{
+  struct page copies[SWAP_BATCH];
+  struct page *batch[SWAP_BATCH];
+  struct list_elem *e;
+  size_t cnt = 0;
+  bool shared;
+
+  lock_acquire (&share_lock);
+  shared = page->shared;
+  if (shared && page->inode == NULL)
+  {
+    /* write before unmapping, so no process faults the page back
+       in before its slot is set */
+    for (e = list_begin (&page->sharers); e != list_end (&page->sharers);
+         e = list_next (e))
+    {
+      struct vm_entry *vme = list_entry (e, struct vm_entry, share_elem);
+
+      if (vme->type != VM_ANON || vme->swap_slot != SWAP_SLOT_NONE)
+        continue;
+      copies[cnt].kaddr = page->kaddr;
+      copies[cnt].vme = vme;
+      copies[cnt].thread = vme->thread;
+      batch[cnt] = &copies[cnt];
+      if (++cnt == SWAP_BATCH)
+      {
+        swap_out_batch (batch, cnt);
+        cnt = 0;
+      }
+    }
+    if (cnt > 0)
+      swap_out_batch (batch, cnt);
+  }
+  if (shared)
+  {
+    for (e = list_begin (&page->sharers); e != list_end (&page->sharers);
+         e = list_next (e))
+    {
+      struct vm_entry *vme = list_entry (e, struct vm_entry, share_elem);
+      pagedir_clear_page (vme->thread->pagedir, vme->vaddr);
+      vme->share = NULL;
+      vme->cow = false;
+      vme->is_loaded = false;
+    }
+    if (page->inode != NULL)
+      hash_delete (&share_table, &page->share_elem);
+    page->inode = NULL;
+    page->shared = false;
+  }
+  lock_release (&share_lock);
+  return shared;
+}
@@ -0,0 +1,20 @@
+#ifndef VM_SHARE_H
+#define VM_SHARE_H
+
+#include <stdbool.h>
+
+struct page;
+struct vm_entry;
+struct thread;
+
+void share_init (void);
+bool share_ok (struct vm_entry *);
+bool share_map (struct vm_entry *);
+void share_add (struct page *);
+bool share_unmap (struct vm_entry *);
+bool share_fork (struct thread *, struct vm_entry *, struct vm_entry *);
+bool share_claim (struct vm_entry *);
+bool share_copy (struct vm_entry *, void *);
+bool share_evict (struct page *);
+
+#endif
@@ -2,13 +2,36 @@
 #include "vm/page.h"
 #include "vm/frame.h"
 #include "devices/block.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
 #include <bitmap.h>
+#include <debug.h>
 #include <stddef.h>
 #include <stdio.h>
 
 static struct bitmap *swap_bitmap; // memory
 static struct block *swap_partition; //disk
 
+/* vm entry holding each used slot and the thread it belongs to,
+   for read-around */
+struct swap_owner
+{
+    struct thread *thread;
+    struct vm_entry *vme;
+};
+static struct swap_owner *swap_owners;
+
+/* slot where the search for free slots starts, just past the
+   last ones handed out, so that runs of slots are handed out in
+   disk order rather than searched for from slot 0 each time */
+static size_t swap_cursor;
+
+/* protects swap_bitmap, swap_owners and swap_cursor */
+static struct lock swap_lock;
+
+static size_t swap_alloc (size_t cnt);
+
 void 
 swap_init ()
 {
@@ -17,36 +40,122 @@ swap_init ()
     swap_partition = block_get_role (BLOCK_SWAP); // disk
     swap_bitmap = bitmap_create (block_size (swap_partition)/8); // memory
     bitmap_set_all (swap_bitmap, true);
+    swap_owners = calloc (bitmap_size (swap_bitmap), sizeof *swap_owners);
+    if (swap_owners == NULL)
+        PANIC ("swap owner table allocation failed");
+    swap_cursor = 0;
+    lock_init (&swap_lock);
+}
+
+/* take CNT consecutive free slots, searching from swap_cursor
+   and wrapping around, return first or BITMAP_ERROR if there is
+   no such run */
+static size_t
+swap_alloc (size_t cnt)
+{
+    size_t slot;
+
+    lock_acquire (&swap_lock);
+    slot = bitmap_scan_and_flip (swap_bitmap, swap_cursor, cnt, true);
+    if (slot == BITMAP_ERROR && swap_cursor != 0)
+        slot = bitmap_scan_and_flip (swap_bitmap, 0, cnt, true);
+    if (slot != BITMAP_ERROR)
+        swap_cursor = (slot + cnt) % bitmap_size (swap_bitmap);
+    lock_release (&swap_lock);
+    return slot;
 }
+
+/* read slot USED_INDEX into KADDR.  The slot stays allocated to its
+   vm entry as a copy of the page, so a page evicted again before it
+   is written needs no swap write; swap_free releases it. */
 void
 swap_in (size_t used_index, void* kaddr)
 {
-    // printf ("=== swap_in! ===\n");
-    // printf ("with slot %d\n", used_index);
+    block_read_multi (swap_partition, used_index*8, 8, kaddr);
+}
 
+/* read the CNT slots in SLOTS into the pages at KADDRS, queued
+   together so that the disk's elevator merges adjacent slots */
+void
+swap_in_batch (size_t *slots, void **kaddrs, size_t cnt)
+{
+    struct block_request reqs[SWAP_BATCH];
+    size_t i;
 
-    int i;  
+    ASSERT (cnt <= SWAP_BATCH);
+    for (i = 0; i < cnt; i++)
+    {
+        block_request_init (&reqs[i], slots[i]*8, 8, kaddrs[i], false);
+        block_submit (swap_partition, &reqs[i]);
+    }
+    for (i = 0; i < cnt; i++)
+        block_wait (&reqs[i]);
+}
 
-    for (i = 0; i < 8; i++)
-        block_read (swap_partition, used_index*8 + i, kaddr + BLOCK_SECTOR_SIZE * i);
+/* release SLOT */
+void
+swap_free (size_t slot)
+{
+    lock_acquire (&swap_lock);
+    bitmap_set (swap_bitmap, slot, true);
+    swap_owners[slot].thread = NULL;
+    swap_owners[slot].vme = NULL;
+    lock_release (&swap_lock);
+}
 
-    
-    bitmap_set (swap_bitmap, used_index, true);
-    // printf ("=== end swap_in ===\n");
+/* store in VMES the vm entries of the current thread, not loaded,
+   whose slots follow SLOT without a gap, up to MAX of them, and
+   return how many.  There are none for SWAP_SLOT_NONE. */
+size_t
+swap_neighbors (size_t slot, struct vm_entry **vmes, size_t max)
+{
+    size_t cnt = 0;
+
+    if (slot == SWAP_SLOT_NONE)
+        return 0;
+    lock_acquire (&swap_lock);
+    for (slot++; cnt < max && slot < bitmap_size (swap_bitmap); slot++)
+    {
+        struct swap_owner *owner = &swap_owners[slot];
+
+        if (bitmap_test (swap_bitmap, slot)
+            || owner->thread != thread_current ()
+            || owner->vme->is_loaded)
+            break;
+        vmes[cnt++] = owner->vme;
+    }
+    lock_release (&swap_lock);
+    return cnt;
 }
-size_t 
-swap_out(void* kaddr)
+
+/* write the CNT pages in PAGES to swap and point the swap_slot of
+   each one's vm entry at its slot.  The slots are taken as one run
+   when possible, and the writes are queued together so that the
+   disk's elevator merges them into one sequential transfer. */
+void
+swap_out_batch (struct page **pages, size_t cnt)
 {
-    // printf ("=== swap_out! ===\n");
-    size_t swap_index = bitmap_scan (swap_bitmap, 0, 1, true);
+    struct block_request reqs[SWAP_BATCH];
+    size_t first, i;
 
-    int i;
-    for (i = 0; i < 8; i++)
-        block_write (swap_partition, swap_index*8 + i, kaddr + BLOCK_SECTOR_SIZE * i);
+    ASSERT (cnt <= SWAP_BATCH);
+    first = swap_alloc (cnt);
 
-    bitmap_set(swap_bitmap, swap_index, false);
+    for (i = 0; i < cnt; i++)
+    {
+        size_t slot = first != BITMAP_ERROR ? first + i : swap_alloc (1);
 
-    // printf ("with slot %d\n", swap_index);
+        if (slot == BITMAP_ERROR)
+            PANIC ("out of swap space");
+        lock_acquire (&swap_lock);
+        swap_owners[slot].thread = pages[i]->thread;
+        swap_owners[slot].vme = pages[i]->vme;
+        lock_release (&swap_lock);
 
-    return swap_index;
-}
\ No newline at end of file
+        pages[i]->vme->swap_slot = slot;
+        block_request_init (&reqs[i], slot*8, 8, pages[i]->kaddr, true);
+        block_submit (swap_partition, &reqs[i]);
+    }
+    for (i = 0; i < cnt; i++)
+        block_wait (&reqs[i]);
+}
@@ -1,10 +1,22 @@
 #include <stdio.h>
 #include <stddef.h>
 
-#ifndef VM_FRAME_H
-#define VM_FRAME_H
+#ifndef VM_SWAP_H
+#define VM_SWAP_H
+
+struct page;
+struct vm_entry;
+
+/* most pages handle_swap evicts and writes out at once */
+#define SWAP_BATCH 8
+
+/* swap_slot of a vm entry that holds no slot */
+#define SWAP_SLOT_NONE ((size_t) -1)
 
 void swap_init ();
 void swap_in (size_t used_index, void* kaddr);
-size_t swap_out (void* kaddr);
-#endif
\ No newline at end of file
+void swap_in_batch (size_t *slots, void **kaddrs, size_t cnt);
+void swap_free (size_t slot);
+size_t swap_neighbors (size_t slot, struct vm_entry **vmes, size_t max);
+void swap_out_batch (struct page **pages, size_t cnt);
+#endif